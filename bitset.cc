@@ -3,23 +3,88 @@
  *  BITSET_AGGREGATE(int column, int max_width)
  *     returns a bitstring with those integer bits set
  *
+ *  BSI_AGGREGATE(int id, int value, int bits, int max_width)
+ *     returns a bit-sliced index holding the value (up to bits wide)
+ *     for each id below 8 * max_width, for use with BSI_RANGE and BSI_SUM
+ *
  * Non-aggregate functions:
  *  BITSET_OR(bitset a, bitset b, ...)
  *     returns the bitwise or of the two arguments
  *  BITSET_AND(bitset a, bitset b, ...)
- *     returns the bitwise and of the two arguments
+ *     returns the bitwise and of the two arguments. Bits of a past the
+ *     end of a shorter b are kept, as if b were padded with ones
  *  BITSET_CREATE(ints...)
  *     returns a new bitset with the given integers set
  *  BITSET_INTERSECTS(bitset a, bitset_b)
  *     returns true if the two bitsets intersect (i.e. a & b is nonzero)
+ *  BITSET_CONTAINS(bitset a, bitset b)
+ *     returns true if every bit set in b is also set in a
+ *  BITSET_RANK(bitset a, int i)
+ *     returns the number of bits set in a below bit i
+ *  BITSET_NTH(bitset a, int n)
+ *     returns the position of the n-th set bit of a, counting from 1,
+ *     or NULL if a has fewer than n bits set
+ *  BITSET_SUMMARIZE(bitset a)
+ *     returns a with a block summary header prepended, which lets the
+ *     *_SUMMARIZED functions skip empty parts of it. The other
+ *     functions take plain bitsets only.
+ *  BITSET_PLAIN(summarized a)
+ *     returns a without its summary header, or NULL if a isn't a
+ *     BITSET_SUMMARIZE result
+ *  BITSET_INTERSECTS_SUMMARIZED(summarized a, summarized b)
+ *  BITSET_CONTAINS_SUMMARIZED(summarized a, summarized b)
+ *     same as BITSET_INTERSECTS and BITSET_CONTAINS for two
+ *     BITSET_SUMMARIZE results, or NULL if either isn't one
+ *  BSI_RANGE(bsi, int lo, int hi)
+ *     returns the bitset of ids in the BSI whose value is between lo
+ *     and hi inclusive
+ *  BSI_SUM(bsi [, bitset filter])
+ *     returns the sum of the values of the ids in filter (or of all
+ *     ids in the BSI)
+ *  BITSET_EVAL(string expr, bitset a, bitset b, ...)
+ *     evaluates expr over the bitset arguments in a single pass. The
+ *     operands are named a, b, c, ... in argument order and may be
+ *     combined with & | ^ ~ and parentheses, e.g. '(a & (b | c)) & ~d'.
+ *     Shorter operands are padded with zeros, so unlike BITSET_AND,
+ *     'a & b' clears the bits of a past the end of b
+ *  BITSET_EVAL_COUNT(string expr, bitset a, ...)
+ *     returns the number of bits set in BITSET_EVAL(expr, a, ...)
+ *  BITSET_EVAL_ANY(string expr, bitset a, ...)
+ *     returns true if BITSET_EVAL(expr, a, ...) has any bit set
  *
  *  create aggregate function  bitset_aggregate returns string soname 'libudf_bitset.so';
+ *  create aggregate function bsi_aggregate returns string soname 'libudf_bitset.so';
  *  create function bitset_or returns string soname 'libudf_bitset.so';
  *  create function bitset_and returns string soname 'libudf_bitset.so';
+ *  create function bitset_contains returns integer soname 'libudf_bitset.so';
+ *  create function bitset_rank returns integer soname 'libudf_bitset.so';
+ *  create function bitset_nth returns integer soname 'libudf_bitset.so';
+ *  create function bitset_summarize returns string soname 'libudf_bitset.so';
+ *  create function bitset_plain returns string soname 'libudf_bitset.so';
+ *  create function bitset_intersects_summarized returns integer soname 'libudf_bitset.so';
+ *  create function bitset_contains_summarized returns integer soname 'libudf_bitset.so';
+ *  create function bsi_range returns string soname 'libudf_bitset.so';
+ *  create function bsi_sum returns integer soname 'libudf_bitset.so';
+ *  create function bitset_eval returns string soname 'libudf_bitset.so';
+ *  create function bitset_eval_count returns integer soname 'libudf_bitset.so';
+ *  create function bitset_eval_any returns integer soname 'libudf_bitset.so';
  *
  *  drop function bitset_aggregate;
+ *  drop function bsi_aggregate;
  *  drop function bitset_or;
  *  drop function bitset_and;
+ *  drop function bitset_contains;
+ *  drop function bitset_rank;
+ *  drop function bitset_nth;
+ *  drop function bitset_summarize;
+ *  drop function bitset_plain;
+ *  drop function bitset_intersects_summarized;
+ *  drop function bitset_contains_summarized;
+ *  drop function bsi_range;
+ *  drop function bsi_sum;
+ *  drop function bitset_eval;
+ *  drop function bitset_eval_count;
+ *  drop function bitset_eval_any;
  */
 
 #ifdef STANDARD
@@ -41,22 +106,7 @@
 #include <m_ctype.h>
 #include <m_string.h>
 
-/* bitset is always a multiple of this number of bytes */
-#define CHUNK_SIZE 8
-#define MAX_SIZE 128
-
-#ifdef DEBUG
-#define dfprintf fprintf
-#else
-#define dfprintf(...) ;
-#endif
-
-typedef struct bitset
-{
-  size_t len;
-  size_t max_len;
-  unsigned char *data;
-} bitset_t;
+#include "bitset_core.h"
 
 
 extern "C" {
@@ -71,6 +121,17 @@ extern "C" {
   void bitset_aggregate_clear(UDF_INIT *initid, char *is_null, char *message);
 
 
+  my_bool bsi_aggregate_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+  void bsi_aggregate_deinit(UDF_INIT *initid);
+  void bsi_aggregate_reset(UDF_INIT *initid, UDF_ARGS *args, char *is_null, char *message);
+  void bsi_aggregate_add(UDF_INIT *initid, UDF_ARGS *args,
+                         char *is_null, char *error);
+  char *bsi_aggregate(UDF_INIT *initid, UDF_ARGS *args,
+                      char *result, unsigned long *length,
+                      char *is_null, char *message);
+  void bsi_aggregate_clear(UDF_INIT *initid, char *is_null, char *message);
+
+
   my_bool bitset_or_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
   void bitset_or_deinit(UDF_INIT *initid);
   char *bitset_or(UDF_INIT *initid, UDF_ARGS *args,
@@ -96,119 +157,77 @@ extern "C" {
                       char *result, unsigned long *length,
                       char *is_null, char *message);
 
-}
-
 
-static bitset_t *bitset_new(size_t initial_len, size_t max_len)
-{
-  bitset_t *data = (bitset_t *)malloc(sizeof(bitset_t));
-  if (!data)
-    return NULL;
+  my_bool bitset_contains_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+  void bitset_contains_deinit(UDF_INIT *initid);
+  longlong bitset_contains(UDF_INIT *initid, UDF_ARGS *args,
+                           char *is_null, char *message);
 
-  data->len = initial_len;
-  data->max_len = max_len;
-  data->data = (unsigned char *)calloc(initial_len, 1);
-  if (!data->data)
-  {
-    free(data);
-    return NULL;
-  }
 
-  return data;
-}
+  my_bool bitset_rank_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+  void bitset_rank_deinit(UDF_INIT *initid);
+  longlong bitset_rank(UDF_INIT *initid, UDF_ARGS *args,
+                       char *is_null, char *message);
 
-static void bitset_free(bitset_t *bs)
-{
-  dfprintf(stderr, "in bitset_free");
-  if (bs->data)
-  {
-    dfprintf(stderr, "freeing bs data\n");
-    free(bs->data);
-    bs->data = NULL;
-  }
-  bs->len = 0;
-  free(bs);
-}
+  my_bool bitset_nth_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+  void bitset_nth_deinit(UDF_INIT *initid);
+  longlong bitset_nth(UDF_INIT *initid, UDF_ARGS *args,
+                      char *is_null, char *message);
 
-static void bitset_clear(bitset_t *bs)
-{
-  dfprintf(stderr, "bitset_clear");
-  bzero(bs->data, bs->len);
-}
 
-static my_bool bitset_ensure_len(bitset_t *bs, size_t len)
-{
-  if (len > bs->max_len)
-  {
-    dfprintf(stderr, "byte is too big!\n");
-    return false; // too high
-  }
+  my_bool bitset_summarize_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+  void bitset_summarize_deinit(UDF_INIT *initid);
+  char *bitset_summarize(UDF_INIT *initid, UDF_ARGS *args,
+                         char *result, unsigned long *length,
+                         char *is_null, char *message);
 
-  // Check for resize
-  if (len > bs->len)
-  {
-    dfprintf(stderr, "Resizing - cur len is %d and need len %d\n", (int)bs->len, (int)len);
-    size_t new_size;
-    size_t chunk_mod = len % CHUNK_SIZE;
-    if (chunk_mod == 0)
-      new_size = len;
-    else
-      new_size = len + (CHUNK_SIZE - chunk_mod);
+  my_bool bitset_plain_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+  void bitset_plain_deinit(UDF_INIT *initid);
+  char *bitset_plain(UDF_INIT *initid, UDF_ARGS *args,
+                     char *result, unsigned long *length,
+                     char *is_null, char *message);
 
-    bs->data = (unsigned char *)realloc(bs->data, new_size);
-    bs->len = new_size;
-    if (!bs->data)
-    {
-      // TODO warning/error
-      return false;
-    }
-  }
+  my_bool bitset_intersects_summarized_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+  void bitset_intersects_summarized_deinit(UDF_INIT *initid);
+  longlong bitset_intersects_summarized(UDF_INIT *initid, UDF_ARGS *args,
+                                        char *is_null, char *message);
 
-  return true;
-}
+  my_bool bitset_contains_summarized_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+  void bitset_contains_summarized_deinit(UDF_INIT *initid);
+  longlong bitset_contains_summarized(UDF_INIT *initid, UDF_ARGS *args,
+                                      char *is_null, char *message);
 
-static void bitset_set(bitset_t *bs, size_t bit) {
-  if (bs->data == NULL)
-    return; // a previous realloc failed
 
-  dfprintf(stderr, "Bit: %d\n", (int)bit);
+  my_bool bsi_range_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+  void bsi_range_deinit(UDF_INIT *initid);
+  char *bsi_range(UDF_INIT *initid, UDF_ARGS *args,
+                  char *result, unsigned long *length,
+                  char *is_null, char *message);
 
-  size_t byte = bit/8;
-  size_t bit_in_byte = bit % 8;
+  my_bool bsi_sum_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+  void bsi_sum_deinit(UDF_INIT *initid);
+  longlong bsi_sum(UDF_INIT *initid, UDF_ARGS *args,
+                   char *is_null, char *message);
 
-  dfprintf(stderr, "Byte: %d\tbib: %d\n", (int)byte, (int)bit_in_byte);
 
-  if (!bitset_ensure_len(bs, byte + 1))
-    return;
-  
-  bs->data[byte] |= 1 << bit_in_byte;
-}
+  my_bool bitset_eval_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+  void bitset_eval_deinit(UDF_INIT *initid);
+  char *bitset_eval(UDF_INIT *initid, UDF_ARGS *args,
+                    char *result, unsigned long *length,
+                    char *is_null, char *message);
 
-static void bitset_or_data(bitset_t *bs, char *data, size_t datalen) {
-  if (!bitset_ensure_len(bs, datalen))
-    return;
+  my_bool bitset_eval_count_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+  void bitset_eval_count_deinit(UDF_INIT *initid);
+  longlong bitset_eval_count(UDF_INIT *initid, UDF_ARGS *args,
+                             char *is_null, char *message);
 
-  dfprintf(stderr, "Orring bs len %d with len %d\n", (int)bs->len, (int)datalen);
+  my_bool bitset_eval_any_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+  void bitset_eval_any_deinit(UDF_INIT *initid);
+  longlong bitset_eval_any(UDF_INIT *initid, UDF_ARGS *args,
+                           char *is_null, char *message);
 
-  for (uint i = 0; i < datalen; i++)
-  {
-    bs->data[i] |= data[i];
-  }
 }
 
-static void bitset_and_data(bitset_t *bs, char *data, size_t datalen) {
-  if (!bitset_ensure_len(bs, datalen))
-    return;
-
-  dfprintf(stderr, "Anding bs len %d with len %d\n", (int)bs->len, (int)datalen);
-
-  for (uint i = 0; i < datalen; i++)
-  {
-    dfprintf(stderr, "anding byte: %d with %d\n", (int)bs->data[i], (int)data[i]);
-    bs->data[i] &= data[i];
-    dfprintf(stderr, "got byte: %d\n", (int)bs->data[i]);
-  }
-}
 
 /************************************************************/
 
@@ -320,9 +339,22 @@ char *bitset_aggregate(UDF_INIT *initid, UDF_ARGS *args,
 }
 
 /************************************************************/
+
+/*
+ * State for BITSET_OR and BITSET_AND. When every argument fits in one
+ * of the fixed widths, init picks that width's kernels and rows of
+ * exactly that width skip the generic (allocating) path.
+ */
+typedef struct bitset_op
+{
+  const bitset_kernels_t *kernels;
+  bitset_t *long_result;  /* last result too long for MySQL's buffer */
+} bitset_op_t;
+
 static my_bool bitset_op_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
 {
   uint i, max_length=0;
+  bitset_op_t *op;
 
   if (args->arg_count < 2)
   {
@@ -341,9 +373,17 @@ static my_bool bitset_op_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
     if (args->lengths[i] > max_length)
       max_length = args->lengths[i];
   }
+  if (!(op = (bitset_op_t *)malloc(sizeof(bitset_op_t))))
+  {
+    strmov(message, "Couldn't allocate memory");
+    return 1;
+  }
+  op->kernels = bitset_kernels_for(max_length);
+  op->long_result = NULL;
+
   initid->max_length = max_length;
   initid->maybe_null = 1; /* if all args are null */
-  initid->ptr = NULL;
+  initid->ptr = (char *)op;
   return 0;
 }
 
@@ -367,14 +407,26 @@ void bitset_op_deinit(UDF_INIT *initid)
   }
 }
 
+static void bitset_op_state_deinit(UDF_INIT *initid)
+{
+  bitset_op_t *op = (bitset_op_t *)initid->ptr;
+  if (op)
+  {
+    if (op->long_result)
+      bitset_free(op->long_result);
+    free(op);
+    initid->ptr = NULL;
+  }
+}
+
 void bitset_or_deinit(UDF_INIT *initid)
 {
-  bitset_op_deinit(initid);
+  bitset_op_state_deinit(initid);
 }
 
 void bitset_and_deinit(UDF_INIT *initid)
 {
-  bitset_op_deinit(initid);
+  bitset_op_state_deinit(initid);
 }
 
 
@@ -387,13 +439,15 @@ static void bitset_op_checkargs(UDF_ARGS *args, char *is_null, unsigned long *ma
     if (args->args[i] == NULL)
       continue;
     *is_null = 0;
-    if (args->lengths[i] > *max_len)
-      *max_len = args->lengths[i];
+    bitset_view_t v;
+    bitset_view_init(&v, args->args[i], args->lengths[i]);
+    if (v.len > *max_len)
+      *max_len = v.len;
   }
 
 }
 
-static char *bitset_op_result(UDF_INIT *initid, bitset_t *bs, unsigned long *length, char *result)
+static char *bitset_keep_result(bitset_t **keep, bitset_t *bs, unsigned long *length, char *result)
 {
   if (*length < 255)
   {
@@ -403,32 +457,89 @@ static char *bitset_op_result(UDF_INIT *initid, bitset_t *bs, unsigned long *len
     return result;
 
   } else {
-    initid->ptr = (char  *)bs;
+    if (*keep)
+      bitset_free(*keep);
+    *keep = bs;
 
     return (char *)bs->data;
   }
 }
 
+static char *bitset_op_result(UDF_INIT *initid, bitset_t *bs, unsigned long *length, char *result)
+{
+  bitset_t *keep = (bitset_t *)initid->ptr;
+  char *res = bitset_keep_result(&keep, bs, length, result);
+  initid->ptr = (char *)keep;
+  return res;
+}
+
+/*
+ * Combines the arguments with op's fixed-width kernels straight into
+ * MySQL's result buffer. Arguments shorter than the width are padded:
+ * with zeros for OR, and with ones for AND so that, as in
+ * bitset_and_view, bytes past their end are left alone.
+ */
+static char *bitset_op_fixed(const bitset_kernels_t *kernels, UDF_ARGS *args,
+                             bool is_and, unsigned long *length, char *result)
+{
+  unsigned char acc[MAX_SIZE];
+  unsigned char padded[MAX_SIZE];
+
+  bzero(acc, kernels->width);
+  for (uint i = 0; i < args->arg_count; i++)
+  {
+    bool first = (i == 0);
+    if (args->args[i] == NULL && !(is_and && first))
+      continue;
+
+    bitset_view_t v;
+    bitset_view_init(&v, args->args[i], args->lengths[i]);
+
+    const char *src = v.data;
+    if (v.len != kernels->width)
+    {
+      memset(padded, (is_and && !first) ? 0xff : 0, kernels->width);
+      if (v.len)
+        memcpy(padded, v.data, v.len);
+      src = (const char *)padded;
+    }
+
+    if (is_and && !first)
+      kernels->and_into(acc, src);
+    else
+      kernels->or_into(acc, src);
+  }
+
+  memcpy(result, acc, *length);
+  return result;
+}
+
 
 char *bitset_or(UDF_INIT *initid, UDF_ARGS *args,
                 char *result, unsigned long *length,
                 char *is_null, char *message)
 {
   /* first determine length and whether it should be null */
+  bitset_op_t *op = (bitset_op_t *)initid->ptr;
   bitset_op_checkargs(args, is_null, length);
   if (*is_null)
     return NULL;
 
+  if (op->kernels && *length <= op->kernels->width)
+    return bitset_op_fixed(op->kernels, args, false, length, result);
 
   /* now allocate the bitset */
   bitset_t *bs = bitset_new(*length, *length);
   for (uint i = 0; i < args->arg_count; i++)
   {
-    if (args->args[i] != NULL)
-      bitset_or_data(bs, args->args[i], args->lengths[i]);
+    if (args->args[i] == NULL)
+      continue;
+    bitset_view_t v;
+    bitset_view_init(&v, args->args[i], args->lengths[i]);
+    bitset_or_view(bs, &v);
   }
 
-  return bitset_op_result(initid, bs, length, result);
+  return bitset_keep_result(&op->long_result, bs, length, result);
 }
 
 char *bitset_and(UDF_INIT *initid, UDF_ARGS *args,
@@ -436,21 +547,29 @@ char *bitset_and(UDF_INIT *initid, UDF_ARGS *args,
                  char *is_null, char *message)
 {
   /* first determine length and whether it should be null */
+  bitset_op_t *op = (bitset_op_t *)initid->ptr;
   bitset_op_checkargs(args, is_null, length);
   if (*is_null)
     return NULL;
 
+  if (op->kernels && *length <= op->kernels->width)
+    return bitset_op_fixed(op->kernels, args, true, length, result);
+
   /* now allocate the bitset */
   bitset_t *bs = bitset_new(*length, *length);
-  bitset_or_data(bs, args->args[0], args->lengths[0]);
+  bitset_view_t v;
+  bitset_view_init(&v, args->args[0], args->lengths[0]);
+  bitset_or_view(bs, &v);
 
   for (uint i = 1; i < args->arg_count; i++)
   {
-    if (args->args[i] != NULL)
-      bitset_and_data(bs, args->args[i], args->lengths[i]);
+    if (args->args[i] == NULL)
+      continue;
+    bitset_view_init(&v, args->args[i], args->lengths[i]);
+    bitset_and_view(bs, &v);
   }
 
-  return bitset_op_result(initid, bs, length, result);
+  return bitset_keep_result(&op->long_result, bs, length, result);
 }
 
 
@@ -536,6 +655,14 @@ my_bool bitset_intersects_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
     return 1;
   }
 
+  /* if both sides share a fixed width, rows of that width use its kernel */
+  const bitset_kernels_t *kernels = bitset_kernels_for(args->lengths[0]);
+  if (args->lengths[0] == args->lengths[1] &&
+      kernels && kernels->width == args->lengths[0])
+    initid->ptr = (char *)kernels;
+  else
+    initid->ptr = NULL;
+
   return 0;
 }
 
@@ -554,22 +681,795 @@ longlong bitset_intersects(UDF_INIT *initid, UDF_ARGS *args,
     return 0;
   }
 
-  uint shorter, longer;
-  if (args->lengths[0] > args->lengths[1])
+  const bitset_kernels_t *kernels = (const bitset_kernels_t *)initid->ptr;
+  if (kernels &&
+      args->lengths[0] == kernels->width &&
+      args->lengths[1] == kernels->width)
   {
-    longer = 0; shorter = 1;
-  } else {
-    longer = 1; shorter = 0;
+    return kernels->intersects(args->args[0], args->args[1]);
+  }
+
+  return bitset_intersects_data(args->args[0], args->lengths[0],
+                                args->args[1], args->lengths[1]);
+}
+
+
+/************************************************************/
+
+/**
+ *  BITSET_CONTAINS(bitset a, bitset b)
+ *     returns true if every bit set in b is also set in a
+ */
+my_bool bitset_contains_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+  if (args->arg_count != 2)
+  {
+    strmov(message, "usage: BITSET_CONTAINS(bitset_a, bitset_b)");
+    return 1;
   }
 
-  for (uint byte = 0; byte < args->lengths[shorter]; byte++)
+  if (args->arg_type[0] != STRING_RESULT ||
+      args->arg_type[1] != STRING_RESULT)
   {
-    if (args->args[shorter][byte] & args->args[longer][byte])
-    {
-      return 1;
-    }
+    strmov(message, "Arguments to BITSET_CONTAINS must be binary");
+    return 1;
+  }
+
+  return 0;
+}
+
+void bitset_contains_deinit(UDF_INIT *initid)
+{
+}
+
+longlong bitset_contains(UDF_INIT *initid, UDF_ARGS *args,
+                         char *is_null, char *message)
+{
+  if (args->args[0] == NULL ||
+      args->args[1] == NULL)
+  {
+    *is_null = 1;
+    return 0;
+  }
+
+  bitset_view_t a, b;
+  bitset_view_init(&a, args->args[0], args->lengths[0]);
+  bitset_view_init(&b, args->args[1], args->lengths[1]);
+  return bitset_contains_view(&a, &b);
+}
+
+/************************************************************/
+
+/**
+ *  BITSET_RANK(bitset a, int i)
+ *  BITSET_NTH(bitset a, int n)
+ *     map between bit positions and their rank among the set bits.
+ *     Both work directly on the argument, so nothing is allocated.
+ */
+static my_bool bitset_position_init(UDF_INIT *initid, UDF_ARGS *args,
+                                    char *message)
+{
+  if (args->arg_count != 2)
+  {
+    strmov(message, "usage: BITSET_RANK(bitset, i) or BITSET_NTH(bitset, n)");
+    return 1;
+  }
+
+  if (args->arg_type[0] != STRING_RESULT ||
+      args->arg_type[1] != INT_RESULT)
+  {
+    strmov(message, "BITSET_RANK and BITSET_NTH take a binary and an INT argument");
+    return 1;
+  }
+
+  initid->maybe_null = 1;
+  return 0;
+}
+
+my_bool bitset_rank_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+  return bitset_position_init(initid, args, message);
+}
+
+void bitset_rank_deinit(UDF_INIT *initid)
+{
+}
+
+longlong bitset_rank(UDF_INIT *initid, UDF_ARGS *args,
+                     char *is_null, char *message)
+{
+  if (args->args[0] == NULL ||
+      args->args[1] == NULL ||
+      *((longlong *)args->args[1]) < 0)
+  {
+    *is_null = 1;
+    return 0;
+  }
+
+  bitset_view_t v;
+  bitset_view_init(&v, args->args[0], args->lengths[0]);
+  return (longlong)bitset_rank(&v, *((longlong *)args->args[1]));
+}
+
+my_bool bitset_nth_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+  return bitset_position_init(initid, args, message);
+}
+
+void bitset_nth_deinit(UDF_INIT *initid)
+{
+}
+
+longlong bitset_nth(UDF_INIT *initid, UDF_ARGS *args,
+                    char *is_null, char *message)
+{
+  if (args->args[0] == NULL ||
+      args->args[1] == NULL ||
+      *((longlong *)args->args[1]) < 1)
+  {
+    *is_null = 1;
+    return 0;
+  }
+
+  bitset_view_t v;
+  bitset_view_init(&v, args->args[0], args->lengths[0]);
+  longlong pos = bitset_select(&v, *((longlong *)args->args[1]) - 1);
+  if (pos < 0)
+  {
+    *is_null = 1;
+    return 0;
+  }
+  return pos;
+}
+
+/************************************************************/
+
+/**
+ *  BITSET_SUMMARIZE(bitset a)
+ *  BITSET_PLAIN(summarized a)
+ *     convert between the summarized and plain encodings
+ */
+static my_bool bitset_convert_init(UDF_INIT *initid, UDF_ARGS *args,
+                                   char *message)
+{
+  if (args->arg_count != 1 ||
+      args->arg_type[0] != STRING_RESULT)
+  {
+    strmov(message, "BITSET_SUMMARIZE and BITSET_PLAIN take one binary argument");
+    return 1;
   }
 
+  initid->max_length = args->lengths[0] + BITSET_SUMMARY_HEADER_LEN;
+  initid->maybe_null = 1;
+  initid->ptr = NULL;
   return 0;
 }
 
+my_bool bitset_summarize_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+  return bitset_convert_init(initid, args, message);
+}
+
+void bitset_summarize_deinit(UDF_INIT *initid)
+{
+  bitset_op_deinit(initid);
+}
+
+char *bitset_summarize(UDF_INIT *initid, UDF_ARGS *args,
+                       char *result, unsigned long *length,
+                       char *is_null, char *message)
+{
+  if (args->args[0] == NULL)
+  {
+    *is_null = 1;
+    return NULL;
+  }
+
+  /* free any buffer left by a previous long result */
+  bitset_op_deinit(initid);
+
+  size_t len = args->lengths[0] + BITSET_SUMMARY_HEADER_LEN;
+  bitset_t *bs = bitset_new(len, len);
+  if (!bs)
+  {
+    *is_null = 1;
+    *message = 1;
+    return NULL;
+  }
+
+  *is_null = 0;
+  *length = bitset_summarize(args->args[0], args->lengths[0], (char *)bs->data);
+  return bitset_op_result(initid, bs, length, result);
+}
+
+my_bool bitset_plain_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+  return bitset_convert_init(initid, args, message);
+}
+
+void bitset_plain_deinit(UDF_INIT *initid)
+{
+}
+
+char *bitset_plain(UDF_INIT *initid, UDF_ARGS *args,
+                   char *result, unsigned long *length,
+                   char *is_null, char *message)
+{
+  if (args->args[0] == NULL)
+  {
+    *is_null = 1;
+    return NULL;
+  }
+
+  bitset_view_t v;
+  if (!bitset_view_init_summarized(&v, args->args[0], args->lengths[0]))
+  {
+    *is_null = 1;
+    return NULL;
+  }
+
+  *is_null = 0;
+  *length = v.len;
+  return (char *)v.data;
+}
+
+/************************************************************/
+
+/**
+ *  BITSET_INTERSECTS_SUMMARIZED(summarized a, summarized b)
+ *  BITSET_CONTAINS_SUMMARIZED(summarized a, summarized b)
+ *     compare two BITSET_SUMMARIZE results, skipping the blocks their
+ *     summaries show to be empty
+ */
+static my_bool bitset_summarized_init(UDF_INIT *initid, UDF_ARGS *args,
+                                      char *message)
+{
+  if (args->arg_count != 2 ||
+      args->arg_type[0] != STRING_RESULT ||
+      args->arg_type[1] != STRING_RESULT)
+  {
+    strmov(message, "BITSET_INTERSECTS_SUMMARIZED and BITSET_CONTAINS_SUMMARIZED take two binary arguments");
+    return 1;
+  }
+
+  initid->maybe_null = 1;
+  return 0;
+}
+
+/* false (and NULL) unless both arguments are summarized bitsets */
+static bool bitset_summarized_args(UDF_ARGS *args, bitset_view_t *a,
+                                   bitset_view_t *b, char *is_null)
+{
+  if (!bitset_view_init_summarized(a, args->args[0], args->lengths[0]) ||
+      !bitset_view_init_summarized(b, args->args[1], args->lengths[1]))
+  {
+    *is_null = 1;
+    return false;
+  }
+  return true;
+}
+
+my_bool bitset_intersects_summarized_init(UDF_INIT *initid, UDF_ARGS *args,
+                                          char *message)
+{
+  return bitset_summarized_init(initid, args, message);
+}
+
+void bitset_intersects_summarized_deinit(UDF_INIT *initid)
+{
+}
+
+longlong bitset_intersects_summarized(UDF_INIT *initid, UDF_ARGS *args,
+                                      char *is_null, char *message)
+{
+  bitset_view_t a, b;
+  if (!bitset_summarized_args(args, &a, &b, is_null))
+    return 0;
+  return bitset_intersects_view(&a, &b);
+}
+
+my_bool bitset_contains_summarized_init(UDF_INIT *initid, UDF_ARGS *args,
+                                        char *message)
+{
+  return bitset_summarized_init(initid, args, message);
+}
+
+void bitset_contains_summarized_deinit(UDF_INIT *initid)
+{
+}
+
+longlong bitset_contains_summarized(UDF_INIT *initid, UDF_ARGS *args,
+                                    char *is_null, char *message)
+{
+  bitset_view_t a, b;
+  if (!bitset_summarized_args(args, &a, &b, is_null))
+    return 0;
+  return bitset_contains_view(&a, &b);
+}
+
+/************************************************************/
+
+/**
+ *  BSI_AGGREGATE(int id, int value, int bits, int max_width)
+ *     builds one bitset per value bit plus one marking the ids present,
+ *     each laid out like a BITSET_AGGREGATE result of at most max_width
+ *     bytes. Unlike BITSET_AGGREGATE, max_width may go up to
+ *     BSI_MAX_WIDTH since the result doesn't have to fit in MySQL's
+ *     result buffer. Ids should be unique within a group; negative ids
+ *     or values, ids of 8 * max_width or more, and values too wide for
+ *     bits are skipped.
+ */
+typedef struct bsi_agg
+{
+  unsigned int bits;
+  ulonglong max_id;   /* ids from here on don't fit in max_width */
+  bitset_t *slices[BSI_MAX_BITS + 1];  /* slices[0] marks the ids present */
+  char *out;
+  size_t out_len;
+} bsi_agg_t;
+
+static void bsi_agg_free(bsi_agg_t *agg)
+{
+  for (uint i = 0; i <= BSI_MAX_BITS; i++)
+  {
+    if (agg->slices[i])
+      bitset_free(agg->slices[i]);
+  }
+  free(agg->out);
+  free(agg);
+}
+
+my_bool bsi_aggregate_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+  bsi_agg_t *agg;
+  longlong bits, maxlen;
+
+  initid->maybe_null = false;
+  initid->ptr = NULL;
+  if (args->arg_count != 4)
+  {
+    strmov(message, "usage: BSI_AGGREGATE(id, value, bits, max_width)");
+    return 1;
+  }
+
+  if (args->arg_type[0] != INT_RESULT ||
+      args->arg_type[1] != INT_RESULT)
+  {
+    strmov(message, "id and value arguments to BSI_AGGREGATE should be INTs");
+    return 1;
+  }
+
+  if (args->arg_type[2] != INT_RESULT ||
+      args->args[2] == 0)
+  {
+    strmov(message, "third argument to BSI_AGGREGATE should be a constant INT");
+    return 1;
+  }
+
+  bits = *((longlong*) args->args[2]);
+  if (bits <= 0 || bits > BSI_MAX_BITS)
+  {
+    strmov(message, "bits for BSI_AGGREGATE must be between 1 and 64");
+    return 1;
+  }
+
+  if (args->arg_type[3] != INT_RESULT ||
+      args->args[3] == 0)
+  {
+    strmov(message, "fourth argument to BSI_AGGREGATE should be a constant INT");
+    return 1;
+  }
+
+  maxlen = *((longlong*) args->args[3]);
+  if (maxlen <= 0 || maxlen > BSI_MAX_WIDTH)
+  {
+    strmov(message, "max_width for BSI_AGGREGATE must be between 1 and 1048576");
+    return 1;
+  }
+
+  if (!(agg = (bsi_agg_t *)calloc(1, sizeof(bsi_agg_t))))
+  {
+    strmov(message, "Couldn't allocate memory");
+    return 1;
+  }
+  agg->bits = (uint)bits;
+  agg->max_id = (ulonglong)maxlen * 8;
+
+  for (uint i = 0; i <= agg->bits; i++)
+  {
+    if (!(agg->slices[i] = bitset_new(CHUNK_SIZE, (size_t)maxlen)))
+    {
+      strmov(message, "Couldn't create empty bitset");
+      bsi_agg_free(agg);
+      return 1;
+    }
+  }
+
+  initid->ptr = (char *)agg;
+  initid->max_length = bsi_encoded_len(agg->bits, (size_t)maxlen);
+  return 0;
+}
+
+void bsi_aggregate_deinit(UDF_INIT *initid)
+{
+  if (initid->ptr)
+    bsi_agg_free((bsi_agg_t *)initid->ptr);
+}
+
+void bsi_aggregate_reset(UDF_INIT *initid, UDF_ARGS *args, char *is_null, char *message)
+{
+  bsi_aggregate_clear(initid, is_null, message);
+  bsi_aggregate_add(initid, args, is_null, message);
+}
+
+void bsi_aggregate_clear(UDF_INIT *initid, char *is_null, char *message)
+{
+  bsi_agg_t *agg = (bsi_agg_t *)initid->ptr;
+  if (!agg)
+    return;
+
+  for (uint i = 0; i <= agg->bits; i++)
+    bitset_clear(agg->slices[i]);
+}
+
+void bsi_aggregate_add(UDF_INIT *initid, UDF_ARGS *args,
+                       char *is_null, char *error)
+{
+  bsi_agg_t *agg = (bsi_agg_t *)initid->ptr;
+  if (args->args[0] == NULL || args->args[1] == NULL)
+    return;
+
+  longlong id = *((longlong*) args->args[0]);
+  longlong value = *((longlong*) args->args[1]);
+  if (id < 0 || value < 0 || (ulonglong)id >= agg->max_id ||
+      (agg->bits < 64 && (ulonglong)value >> agg->bits))
+    return;
+
+  bitset_set(agg->slices[0], (size_t)id);
+  for (uint i = 0; i < agg->bits; i++)
+  {
+    if ((value >> i) & 1)
+      bitset_set(agg->slices[i + 1], (size_t)id);
+  }
+}
+
+char *bsi_aggregate(UDF_INIT *initid, UDF_ARGS *args,
+                    char *result, unsigned long *length,
+                    char *is_null, char *message)
+{
+  bsi_agg_t *agg = (bsi_agg_t *)initid->ptr;
+  if (!agg)
+  {
+    *is_null = 1;
+    return NULL;
+  }
+
+  /* pad every slice to the longest one */
+  size_t slice_len = 0;
+  for (uint i = 0; i <= agg->bits; i++)
+  {
+    if (agg->slices[i]->len > slice_len)
+      slice_len = agg->slices[i]->len;
+  }
+
+  size_t len = bsi_encoded_len(agg->bits, slice_len);
+  if (len > agg->out_len)
+  {
+    char *out = (char *)realloc(agg->out, len);
+    if (!out)
+    {
+      *is_null = 1;
+      return NULL;
+    }
+    agg->out = out;
+    agg->out_len = len;
+  }
+
+  bsi_write_header(agg->out, agg->bits, slice_len);
+  char *slice = agg->out + BSI_HEADER_LEN;
+  for (uint i = 0; i <= agg->bits; i++, slice += slice_len)
+  {
+    bitset_t *bs = agg->slices[i];
+    memcpy(slice, bs->data, bs->len);
+    bzero(slice + bs->len, slice_len - bs->len);
+  }
+
+  *is_null = 0;
+  *length = len;
+  return agg->out;
+}
+
+/************************************************************/
+
+/**
+ *  BSI_RANGE(bsi, int lo, int hi)
+ *  BSI_SUM(bsi [, bitset filter])
+ */
+my_bool bsi_range_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+  if (args->arg_count != 3 ||
+      args->arg_type[0] != STRING_RESULT ||
+      args->arg_type[1] != INT_RESULT ||
+      args->arg_type[2] != INT_RESULT)
+  {
+    strmov(message, "usage: BSI_RANGE(bsi, lo, hi)");
+    return 1;
+  }
+
+  /* a slice is never longer than the BSI it comes from */
+  initid->maybe_null = 1;
+  initid->max_length = (args->lengths[0] && args->lengths[0] < BSI_MAX_WIDTH) ?
+                       args->lengths[0] : BSI_MAX_WIDTH;
+  initid->ptr = NULL;
+  return 0;
+}
+
+void bsi_range_deinit(UDF_INIT *initid)
+{
+  bitset_op_deinit(initid);
+}
+
+char *bsi_range(UDF_INIT *initid, UDF_ARGS *args,
+                char *result, unsigned long *length,
+                char *is_null, char *message)
+{
+  bsi_view_t v;
+  if (args->args[1] == NULL || args->args[2] == NULL ||
+      !bsi_view_init(&v, args->args[0], args->lengths[0]))
+  {
+    *is_null = 1;
+    return NULL;
+  }
+
+  /* free any buffer left by a previous long result */
+  bitset_op_deinit(initid);
+
+  bitset_t *bs = bitset_new(v.slice_len, v.slice_len);
+  if (!bs)
+  {
+    *is_null = 1;
+    *message = 1;
+    return NULL;
+  }
+
+  longlong lo = *((longlong*) args->args[1]);
+  longlong hi = *((longlong*) args->args[2]);
+  if (hi >= 0)
+    bsi_range(&v, lo < 0 ? 0 : lo, hi, (char *)bs->data);
+
+  *is_null = 0;
+  *length = v.slice_len;
+  return bitset_op_result(initid, bs, length, result);
+}
+
+my_bool bsi_sum_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+  if (args->arg_count < 1 || args->arg_count > 2 ||
+      args->arg_type[0] != STRING_RESULT ||
+      (args->arg_count == 2 && args->arg_type[1] != STRING_RESULT))
+  {
+    strmov(message, "usage: BSI_SUM(bsi [, filter_bitset])");
+    return 1;
+  }
+
+  initid->maybe_null = 1;
+  return 0;
+}
+
+void bsi_sum_deinit(UDF_INIT *initid)
+{
+}
+
+longlong bsi_sum(UDF_INIT *initid, UDF_ARGS *args,
+                 char *is_null, char *message)
+{
+  bsi_view_t v;
+  if (!bsi_view_init(&v, args->args[0], args->lengths[0]) ||
+      (args->arg_count == 2 && args->args[1] == NULL))
+  {
+    *is_null = 1;
+    return 0;
+  }
+
+  if (args->arg_count == 1)
+    return (longlong)bsi_sum(&v, NULL);
+
+  bitset_view_t filter;
+  bitset_view_init(&filter, args->args[1], args->lengths[1]);
+  return (longlong)bsi_sum(&v, &filter);
+}
+
+/************************************************************/
+
+/**
+ *  BITSET_EVAL(string expr, bitset a, bitset b, ...)
+ *     see eval_prog_t in bitset_core.h
+ */
+
+static my_bool bitset_eval_common_init(UDF_INIT *initid, UDF_ARGS *args,
+                                       char *message)
+{
+  eval_prog_t *prog;
+  size_t max_length = 0;
+
+  initid->ptr = NULL;
+  if (args->arg_count < 2)
+  {
+    strmov(message, "usage: BITSET_EVAL(expr, bitset_a, ...)");
+    return 1;
+  }
+
+  if (args->arg_type[0] != STRING_RESULT ||
+      args->args[0] == NULL)
+  {
+    strmov(message, "first argument to BITSET_EVAL should be a constant string");
+    return 1;
+  }
+
+  if (args->arg_count - 1 > EVAL_MAX_OPERANDS)
+  {
+    strmov(message, "BITSET_EVAL takes at most 26 bitset arguments");
+    return 1;
+  }
+
+  for (uint i = 1; i < args->arg_count; i++)
+  {
+    if (args->arg_type[i] != STRING_RESULT)
+    {
+      strmov(message, "BITSET_EVAL operand arguments must be BINARY");
+      return 1;
+    }
+    if (args->lengths[i] > max_length)
+      max_length = args->lengths[i];
+  }
+
+  if (!(prog = eval_prog_new(args->arg_count - 1)))
+  {
+    strmov(message, "Couldn't allocate memory");
+    return 1;
+  }
+
+  if (!eval_prog_compile(prog, args->args[0], args->lengths[0], message))
+    goto err;
+
+  if (!eval_prog_reserve(prog, max_length ? max_length : CHUNK_SIZE))
+  {
+    strmov(message, "Couldn't allocate memory");
+    goto err;
+  }
+
+  initid->ptr = (char *)prog;
+  initid->max_length = max_length;
+  initid->maybe_null = 1;  /* if any operand is null */
+  return 0;
+
+  err:
+  eval_prog_free(prog);
+  return 1;
+}
+
+static void bitset_eval_common_deinit(UDF_INIT *initid)
+{
+  eval_prog_t *prog = (eval_prog_t *)initid->ptr;
+  if (prog)
+  {
+    eval_prog_free(prog);
+    initid->ptr = NULL;
+  }
+}
+
+/*
+ * Works out the plain operand bytes and result length for this row and
+ * makes room for the result. Returns false (with *is_null set) if any
+ * operand is NULL.
+ */
+static bool bitset_eval_prepare(UDF_INIT *initid, UDF_ARGS *args,
+                                const char **operands, unsigned long *lens,
+                                size_t *len, char *is_null, char *error)
+{
+  eval_prog_t *prog = (eval_prog_t *)initid->ptr;
+
+  *len = 0;
+  for (uint i = 1; i < args->arg_count; i++)
+  {
+    if (args->args[i] == NULL)
+    {
+      *is_null = 1;
+      return false;
+    }
+
+    bitset_view_t v;
+    bitset_view_init(&v, args->args[i], args->lengths[i]);
+    operands[i - 1] = v.data;
+    lens[i - 1] = v.len;
+    if (v.len > *len)
+      *len = v.len;
+  }
+
+  /* eval_prog_run writes whole blocks into the buffer */
+  size_t blocks = (*len + EVAL_BLOCK_BYTES - 1) / EVAL_BLOCK_BYTES;
+  if (!eval_prog_reserve(prog, blocks * EVAL_BLOCK_BYTES))
+  {
+    *error = 1;
+    *is_null = 1;
+    return false;
+  }
+
+  *is_null = 0;
+  return true;
+}
+
+my_bool bitset_eval_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+  return bitset_eval_common_init(initid, args, message);
+}
+
+void bitset_eval_deinit(UDF_INIT *initid)
+{
+  bitset_eval_common_deinit(initid);
+}
+
+char *bitset_eval(UDF_INIT *initid, UDF_ARGS *args,
+                  char *result, unsigned long *length,
+                  char *is_null, char *message)
+{
+  eval_prog_t *prog = (eval_prog_t *)initid->ptr;
+  const char *operands[EVAL_MAX_OPERANDS];
+  unsigned long lens[EVAL_MAX_OPERANDS];
+  size_t len;
+
+  if (!bitset_eval_prepare(initid, args, operands, lens, &len, is_null, message))
+    return NULL;
+
+  eval_prog_run(prog, operands, lens, len, false);
+  *length = len;
+  return (char *)prog->buf;
+}
+
+my_bool bitset_eval_count_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+  return bitset_eval_common_init(initid, args, message);
+}
+
+void bitset_eval_count_deinit(UDF_INIT *initid)
+{
+  bitset_eval_common_deinit(initid);
+}
+
+longlong bitset_eval_count(UDF_INIT *initid, UDF_ARGS *args,
+                           char *is_null, char *message)
+{
+  eval_prog_t *prog = (eval_prog_t *)initid->ptr;
+  const char *operands[EVAL_MAX_OPERANDS];
+  unsigned long lens[EVAL_MAX_OPERANDS];
+  size_t len;
+
+  if (!bitset_eval_prepare(initid, args, operands, lens, &len, is_null, message))
+    return 0;
+
+  return (longlong)eval_prog_run(prog, operands, lens, len, false);
+}
+
+my_bool bitset_eval_any_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+  return bitset_eval_common_init(initid, args, message);
+}
+
+void bitset_eval_any_deinit(UDF_INIT *initid)
+{
+  bitset_eval_common_deinit(initid);
+}
+
+longlong bitset_eval_any(UDF_INIT *initid, UDF_ARGS *args,
+                         char *is_null, char *message)
+{
+  eval_prog_t *prog = (eval_prog_t *)initid->ptr;
+  const char *operands[EVAL_MAX_OPERANDS];
+  unsigned long lens[EVAL_MAX_OPERANDS];
+  size_t len;
+
+  if (!bitset_eval_prepare(initid, args, operands, lens, &len, is_null, message))
+    return 0;
+
+  return eval_prog_run(prog, operands, lens, len, true) ? 1 : 0;
+}
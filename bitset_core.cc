@@ -0,0 +1,1045 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bitset_core.h"
+
+#if defined(__BMI2__)
+#include <immintrin.h>
+#elif defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_PDEP_DISPATCH 1  /* pick PDEP at run time */
+#endif
+
+#ifdef DEBUG
+#define dfprintf fprintf
+#else
+#define dfprintf(...) ;
+#endif
+
+bitset_t *bitset_new(size_t initial_len, size_t max_len)
+{
+  bitset_t *data = (bitset_t *)malloc(sizeof(bitset_t));
+  if (!data)
+    return NULL;
+
+  data->len = initial_len;
+  data->max_len = max_len;
+  data->data = (unsigned char *)calloc(initial_len, 1);
+  if (!data->data)
+  {
+    free(data);
+    return NULL;
+  }
+
+  return data;
+}
+
+void bitset_free(bitset_t *bs)
+{
+  dfprintf(stderr, "in bitset_free");
+  if (bs->data)
+  {
+    dfprintf(stderr, "freeing bs data\n");
+    free(bs->data);
+    bs->data = NULL;
+  }
+  bs->len = 0;
+  free(bs);
+}
+
+void bitset_clear(bitset_t *bs)
+{
+  dfprintf(stderr, "bitset_clear");
+  memset(bs->data, 0, bs->len);
+}
+
+bool bitset_ensure_len(bitset_t *bs, size_t len)
+{
+  if (len > bs->max_len)
+  {
+    dfprintf(stderr, "byte is too big!\n");
+    return false; // too high
+  }
+
+  // Check for resize
+  if (len > bs->len)
+  {
+    dfprintf(stderr, "Resizing - cur len is %d and need len %d\n", (int)bs->len, (int)len);
+    size_t new_size;
+    size_t chunk_mod = len % CHUNK_SIZE;
+    if (chunk_mod == 0)
+      new_size = len;
+    else
+      new_size = len + (CHUNK_SIZE - chunk_mod);
+
+    size_t old_len = bs->len;
+    bs->data = (unsigned char *)realloc(bs->data, new_size);
+    bs->len = new_size;
+    if (!bs->data)
+    {
+      // TODO warning/error
+      return false;
+    }
+    memset(bs->data + old_len, 0, new_size - old_len);
+  }
+
+  return true;
+}
+
+void bitset_set(bitset_t *bs, size_t bit) {
+  if (bs->data == NULL)
+    return; // a previous realloc failed
+
+  dfprintf(stderr, "Bit: %d\n", (int)bit);
+
+  size_t byte = bit/8;
+  size_t bit_in_byte = bit % 8;
+
+  dfprintf(stderr, "Byte: %d\tbib: %d\n", (int)byte, (int)bit_in_byte);
+
+  if (!bitset_ensure_len(bs, byte + 1))
+    return;
+  
+  bs->data[byte] |= 1 << bit_in_byte;
+}
+
+void bitset_or_data(bitset_t *bs, const char *data, size_t datalen) {
+  if (!bitset_ensure_len(bs, datalen))
+    return;
+
+  dfprintf(stderr, "Orring bs len %d with len %d\n", (int)bs->len, (int)datalen);
+
+  for (size_t i = 0; i < datalen; i++)
+  {
+    bs->data[i] |= data[i];
+  }
+}
+
+void bitset_and_data(bitset_t *bs, const char *data, size_t datalen) {
+  if (!bitset_ensure_len(bs, datalen))
+    return;
+
+  dfprintf(stderr, "Anding bs len %d with len %d\n", (int)bs->len, (int)datalen);
+
+  for (size_t i = 0; i < datalen; i++)
+  {
+    dfprintf(stderr, "anding byte: %d with %d\n", (int)bs->data[i], (int)data[i]);
+    bs->data[i] &= data[i];
+    dfprintf(stderr, "got byte: %d\n", (int)bs->data[i]);
+  }
+}
+
+/************************************************************/
+
+template <size_t WIDTH>
+struct fixed_kernels
+{
+  enum { WORDS = WIDTH / 8 };
+
+  /*
+   * Word order doesn't matter for bitwise operations, so the words are
+   * just copied in and out in native byte order.
+   */
+  static void or_into(unsigned char *dst, const char *src)
+  {
+    unsigned long long d[WORDS], s[WORDS];
+    memcpy(d, dst, WIDTH);
+    memcpy(s, src, WIDTH);
+    for (size_t i = 0; i < WORDS; i++)
+      d[i] |= s[i];
+    memcpy(dst, d, WIDTH);
+  }
+
+  static void and_into(unsigned char *dst, const char *src)
+  {
+    unsigned long long d[WORDS], s[WORDS];
+    memcpy(d, dst, WIDTH);
+    memcpy(s, src, WIDTH);
+    for (size_t i = 0; i < WORDS; i++)
+      d[i] &= s[i];
+    memcpy(dst, d, WIDTH);
+  }
+
+  static bool intersects(const char *a, const char *b)
+  {
+    unsigned long long wa[WORDS], wb[WORDS], acc = 0;
+    memcpy(wa, a, WIDTH);
+    memcpy(wb, b, WIDTH);
+    for (size_t i = 0; i < WORDS; i++)
+      acc |= wa[i] & wb[i];
+    return acc != 0;
+  }
+};
+
+#define FIXED_KERNELS(width) \
+  { width, fixed_kernels<width>::or_into, \
+    fixed_kernels<width>::and_into, fixed_kernels<width>::intersects }
+
+static const bitset_kernels_t fixed_kernel_table[] = {
+  FIXED_KERNELS(8),
+  FIXED_KERNELS(16),
+  FIXED_KERNELS(32),
+  FIXED_KERNELS(64),
+  FIXED_KERNELS(128)
+};
+
+const bitset_kernels_t *bitset_kernels_for(size_t len)
+{
+  for (size_t i = 0; i < sizeof(fixed_kernel_table) / sizeof(fixed_kernel_table[0]); i++)
+  {
+    if (len <= fixed_kernel_table[i].width)
+      return &fixed_kernel_table[i];
+  }
+  return NULL;
+}
+
+/************************************************************/
+
+static const unsigned char summary_magic[4] = { 0xff, 'B', 'S', 0x01 };
+
+static unsigned long long read_le(const char *p, unsigned int nbytes)
+{
+  unsigned long long v = 0;
+  for (unsigned int i = 0; i < nbytes; i++)
+    v |= (unsigned long long)(unsigned char)p[i] << (8 * i);
+  return v;
+}
+
+static void write_le(char *p, unsigned long long v, unsigned int nbytes)
+{
+  for (unsigned int i = 0; i < nbytes; i++)
+    p[i] = (char)(v >> (8 * i));
+}
+
+/* byte range [*start, *end) covered by summary bit k */
+static void summary_block(unsigned int k, size_t len, size_t *start, size_t *end)
+{
+  *start = (size_t)k * BITSET_SUMMARY_BLOCK;
+  if (k == BITSET_SUMMARY_BLOCKS - 1)
+    *end = len;
+  else
+    *end = *start + BITSET_SUMMARY_BLOCK;
+
+  if (*end > len)
+    *end = len;
+  if (*start > *end)
+    *start = *end;
+}
+
+/*
+ * Cheap checks that a header is consistent with the len bytes
+ * following it: no summary bits past the end of the data, a count of
+ * zero exactly when the summary is empty, and a count that the
+ * summarized blocks could actually hold.
+ */
+static bool summary_header_valid(unsigned long long count,
+                                 unsigned long long summary, size_t len)
+{
+  size_t nblocks = (len + BITSET_SUMMARY_BLOCK - 1) / BITSET_SUMMARY_BLOCK;
+  if (nblocks < BITSET_SUMMARY_BLOCKS && (summary >> nblocks) != 0)
+    return false;
+  if ((count == 0) != (summary == 0))
+    return false;
+  if (count > 8 * (unsigned long long)len)
+    return false;
+
+  unsigned int blocks = __builtin_popcountll(summary);
+  if (count < blocks)
+    return false;
+  if (!(summary >> (BITSET_SUMMARY_BLOCKS - 1)) &&
+      count > 8ULL * BITSET_SUMMARY_BLOCK * blocks)
+    return false;
+  return true;
+}
+
+void bitset_view_init(bitset_view_t *v, const char *data, size_t len)
+{
+  v->has_summary = false;
+  v->summary = ~0ULL;
+  v->count = 0;
+
+  if (data == NULL)
+  {
+    v->data = NULL;
+    v->len = 0;
+    v->summary = 0;
+    return;
+  }
+
+  v->data = data;
+  v->len = len;
+}
+
+bool bitset_view_init_summarized(bitset_view_t *v, const char *data, size_t len)
+{
+  if (data == NULL ||
+      len < BITSET_SUMMARY_HEADER_LEN ||
+      memcmp(data, summary_magic, sizeof(summary_magic)) != 0)
+    return false;
+
+  unsigned long long count = read_le(data + 4, 4);
+  unsigned long long summary = read_le(data + 8, 8);
+  if (!summary_header_valid(count, summary, len - BITSET_SUMMARY_HEADER_LEN))
+    return false;
+
+  v->has_summary = true;
+  v->count = (unsigned int)count;
+  v->summary = summary;
+  v->data = data + BITSET_SUMMARY_HEADER_LEN;
+  v->len = len - BITSET_SUMMARY_HEADER_LEN;
+  return true;
+}
+
+size_t bitset_summarize(const char *data, size_t len, char *out)
+{
+  bitset_view_t v;
+  bitset_view_init(&v, data, len);
+
+  unsigned long long summary = 0;
+  unsigned long long count = 0;
+  for (size_t i = 0; i < v.len; i++)
+  {
+    unsigned char byte = v.data[i];
+    if (!byte)
+      continue;
+
+    size_t k = i / BITSET_SUMMARY_BLOCK;
+    if (k >= BITSET_SUMMARY_BLOCKS)
+      k = BITSET_SUMMARY_BLOCKS - 1;
+    summary |= 1ULL << k;
+    count += __builtin_popcount(byte);
+  }
+
+  memcpy(out, summary_magic, sizeof(summary_magic));
+  write_le(out + 4, count, 4);
+  write_le(out + 8, summary, 8);
+  memmove(out + BITSET_SUMMARY_HEADER_LEN, v.data, v.len);
+  return BITSET_SUMMARY_HEADER_LEN + v.len;
+}
+
+void bitset_or_view(bitset_t *bs, const bitset_view_t *v)
+{
+  if (!bitset_ensure_len(bs, v->len))
+    return;
+
+  /* empty blocks leave bs unchanged */
+  unsigned long long blocks = v->summary;
+  while (blocks)
+  {
+    size_t start, end;
+    summary_block(__builtin_ctzll(blocks), v->len, &start, &end);
+    blocks &= blocks - 1;
+
+    for (size_t i = start; i < end; i++)
+      bs->data[i] |= v->data[i];
+  }
+}
+
+void bitset_and_view(bitset_t *bs, const bitset_view_t *v)
+{
+  if (!bitset_ensure_len(bs, v->len))
+    return;
+
+  for (unsigned int k = 0; k < BITSET_SUMMARY_BLOCKS; k++)
+  {
+    size_t start, end;
+    summary_block(k, v->len, &start, &end);
+    if (start == end)
+      break;
+
+    if (v->summary & (1ULL << k))
+    {
+      for (size_t i = start; i < end; i++)
+        bs->data[i] &= v->data[i];
+    }
+    else
+    {
+      memset(bs->data + start, 0, end - start);
+    }
+  }
+}
+
+bool bitset_intersects_view(const bitset_view_t *a, const bitset_view_t *b)
+{
+  /* only blocks non-empty in both can intersect */
+  unsigned long long blocks = a->summary & b->summary;
+  size_t len = (a->len < b->len) ? a->len : b->len;
+
+  while (blocks)
+  {
+    size_t start, end;
+    summary_block(__builtin_ctzll(blocks), len, &start, &end);
+    blocks &= blocks - 1;
+    if (start == end)
+      break;
+
+    for (size_t byte = start; byte < end; byte++)
+    {
+      if (a->data[byte] & b->data[byte])
+        return true;
+    }
+  }
+
+  return false;
+}
+
+bool bitset_intersects_data(const char *a, size_t alen,
+                            const char *b, size_t blen)
+{
+  bitset_view_t va, vb;
+  bitset_view_init(&va, a, alen);
+  bitset_view_init(&vb, b, blen);
+  return bitset_intersects_view(&va, &vb);
+}
+
+bool bitset_contains_view(const bitset_view_t *a, const bitset_view_t *b)
+{
+  if (a->has_summary && b->has_summary &&
+      (b->count > a->count || (b->summary & ~a->summary)))
+    return false;
+
+  /* bits of b in blocks that are empty in a can't be contained */
+  unsigned long long blocks = b->summary;
+  while (blocks)
+  {
+    size_t start, end;
+    summary_block(__builtin_ctzll(blocks), b->len, &start, &end);
+    blocks &= blocks - 1;
+    if (start == end)
+      break;
+
+    for (size_t byte = start; byte < end; byte++)
+    {
+      unsigned char in_a = (byte < a->len) ? a->data[byte] : 0;
+      if ((unsigned char)b->data[byte] & ~in_a)
+        return false;
+    }
+  }
+
+  return true;
+}
+
+/* reads up to 8 bytes as a little-endian word, zero-filling the rest */
+static inline unsigned long long load_word(const char *p, size_t nbytes)
+{
+  unsigned long long w = 0;
+  memcpy(&w, p, nbytes);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  w = __builtin_bswap64(w);
+#endif
+  return w;
+}
+
+#ifndef __BMI2__
+static unsigned int select_in_word_bytes(unsigned long long w, unsigned int n)
+{
+  unsigned int base = 0;
+  for (;;)
+  {
+    unsigned int byte = (unsigned int)(w & 0xff);
+    unsigned int c = __builtin_popcount(byte);
+    if (n < c)
+    {
+      while (n--)
+        byte &= byte - 1;
+      return base + __builtin_ctz(byte);
+    }
+    n -= c;
+    w >>= 8;
+    base += 8;
+  }
+}
+#endif
+
+#ifdef HAVE_PDEP_DISPATCH
+/*
+ * PDEP deposits a single bit at the n-th set bit of w in one
+ * instruction. Built for BMI2 regardless of the compiler flags, and
+ * only called once the CPU is known to support it.
+ */
+__attribute__((target("bmi2")))
+static unsigned int select_in_word_pdep(unsigned long long w, unsigned int n)
+{
+  return __builtin_ctzll(_pdep_u64(1ULL << n, w));
+}
+
+static bool cpu_has_bmi2()
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("bmi2");
+}
+#endif
+
+/* position of the n-th set bit of w, counting from 0; w has more than n bits set */
+static inline unsigned int select_in_word(unsigned long long w, unsigned int n)
+{
+#if defined(__BMI2__)
+  return __builtin_ctzll(_pdep_u64(1ULL << n, w));
+#elif defined(HAVE_PDEP_DISPATCH)
+  static const bool has_bmi2 = cpu_has_bmi2();
+  if (has_bmi2)
+    return select_in_word_pdep(w, n);
+  return select_in_word_bytes(w, n);
+#else
+  return select_in_word_bytes(w, n);
+#endif
+}
+
+unsigned long long bitset_rank(const bitset_view_t *v, unsigned long long i)
+{
+  unsigned long long rank = 0;
+  size_t nbytes = (i / 8 < v->len) ? (size_t)(i / 8) : v->len;
+  size_t byte = 0;
+
+  for (; byte + 8 <= nbytes; byte += 8)
+    rank += __builtin_popcountll(load_word(v->data + byte, 8));
+  if (byte < nbytes)
+    rank += __builtin_popcountll(load_word(v->data + byte, nbytes - byte));
+
+  /* the bits of byte i/8 below i */
+  if (nbytes < v->len && i % 8)
+    rank += __builtin_popcount((unsigned char)v->data[nbytes] & ((1u << (i % 8)) - 1));
+
+  return rank;
+}
+
+long long bitset_select(const bitset_view_t *v, unsigned long long n)
+{
+  if (v->has_summary && n >= v->count)
+    return -1;
+
+  for (size_t byte = 0; byte < v->len; byte += 8)
+  {
+    size_t nbytes = (v->len - byte < 8) ? v->len - byte : 8;
+    unsigned long long w = load_word(v->data + byte, nbytes);
+    unsigned int c = __builtin_popcountll(w);
+    if (n < c)
+      return (long long)(byte * 8 + select_in_word(w, (unsigned int)n));
+    n -= c;
+  }
+
+  return -1;
+}
+
+/************************************************************/
+
+static const unsigned char bsi_magic[4] = { 'B', 'S', 'I', 0x01 };
+
+bool bsi_view_init(bsi_view_t *v, const char *data, size_t len)
+{
+  if (data == NULL ||
+      len < BSI_HEADER_LEN ||
+      memcmp(data, bsi_magic, sizeof(bsi_magic)) != 0)
+    return false;
+
+  v->bits = (unsigned char)data[4];
+  v->slice_len = (size_t)read_le(data + 8, 4);
+  if (v->bits == 0 || v->bits > BSI_MAX_BITS ||
+      len != bsi_encoded_len(v->bits, v->slice_len))
+    return false;
+
+  v->exists = data + BSI_HEADER_LEN;
+  v->slices = v->exists + v->slice_len;
+  return true;
+}
+
+size_t bsi_encoded_len(unsigned int bits, size_t slice_len)
+{
+  return BSI_HEADER_LEN + (bits + 1) * slice_len;
+}
+
+void bsi_write_header(char *out, unsigned int bits, size_t slice_len)
+{
+  memcpy(out, bsi_magic, sizeof(bsi_magic));
+  out[4] = (char)bits;
+  memset(out + 5, 0, 3);
+  write_le(out + 8, slice_len, 4);
+}
+
+void bsi_range(const bsi_view_t *v, unsigned long long lo,
+               unsigned long long hi, char *out)
+{
+  unsigned long long max = (v->bits == 64) ? ~0ULL : (1ULL << v->bits) - 1;
+  if (hi > max)
+    hi = max;
+
+  for (size_t byte = 0; byte < v->slice_len; byte += 8)
+  {
+    size_t nbytes = (v->slice_len - byte < 8) ? v->slice_len - byte : 8;
+    unsigned long long exists = load_word(v->exists + byte, nbytes);
+    unsigned long long result = 0;
+
+    if (lo <= hi && exists)
+    {
+      /*
+       * Walk down from the top bit, tracking the ids whose value so far
+       * equals lo's (resp. hi's) prefix, and those already known to be
+       * greater than lo (resp. less than hi).
+       */
+      unsigned long long gt = 0, eq_lo = exists;
+      unsigned long long lt = 0, eq_hi = exists;
+      for (int i = v->bits - 1; i >= 0; i--)
+      {
+        unsigned long long slice =
+          load_word(v->slices + i * v->slice_len + byte, nbytes);
+
+        if ((lo >> i) & 1)
+          eq_lo &= slice;
+        else
+        {
+          gt |= eq_lo & slice;
+          eq_lo &= ~slice;
+        }
+
+        if ((hi >> i) & 1)
+        {
+          lt |= eq_hi & ~slice;
+          eq_hi &= slice;
+        }
+        else
+          eq_hi &= ~slice;
+      }
+      result = (gt | eq_lo) & (lt | eq_hi);
+    }
+
+    write_le(out + byte, result, nbytes);
+  }
+}
+
+unsigned long long bsi_sum(const bsi_view_t *v, const bitset_view_t *filter)
+{
+  unsigned long long sum = 0;
+
+  for (size_t byte = 0; byte < v->slice_len; byte += 8)
+  {
+    size_t nbytes = (v->slice_len - byte < 8) ? v->slice_len - byte : 8;
+    unsigned long long mask = load_word(v->exists + byte, nbytes);
+
+    if (filter)
+    {
+      size_t fbytes = (byte >= filter->len) ? 0 :
+                      (filter->len - byte < nbytes) ? filter->len - byte : nbytes;
+      mask &= load_word(filter->data + byte, fbytes);
+    }
+    if (!mask)
+      continue;
+
+    for (unsigned int i = 0; i < v->bits; i++)
+    {
+      unsigned long long slice =
+        load_word(v->slices + i * v->slice_len + byte, nbytes);
+      sum += (unsigned long long)__builtin_popcountll(slice & mask) << i;
+    }
+  }
+
+  return sum;
+}
+
+void bitset_intersects_batch(const char *const *bitsets, const size_t *lens,
+                             size_t n, const char *mask, size_t masklen,
+                             char *out)
+{
+  for (size_t i = 0; i < n; i++)
+  {
+    out[i] = bitsets[i] != NULL &&
+             bitset_intersects_data(bitsets[i], lens[i], mask, masklen);
+  }
+}
+
+void bitset_intersects_column(const char *data, const size_t *offsets,
+                              size_t n, const char *mask, size_t masklen,
+                              char *out)
+{
+  for (size_t i = 0; i < n; i++)
+  {
+    out[i] = bitset_intersects_data(data + offsets[i],
+                                    offsets[i + 1] - offsets[i],
+                                    mask, masklen);
+  }
+}
+
+typedef struct intersects_column_ctx
+{
+  const char *data;
+  const size_t *offsets;
+  const char *mask;
+  size_t masklen;
+  char *out;
+} intersects_column_ctx_t;
+
+static void intersects_column_chunk(void *arg, size_t begin, size_t end)
+{
+  intersects_column_ctx_t *ctx = (intersects_column_ctx_t *)arg;
+  bitset_intersects_column(ctx->data, ctx->offsets + begin, end - begin,
+                           ctx->mask, ctx->masklen, ctx->out + begin);
+}
+
+void bitset_intersects_column_parallel(work_pool_t *pool,
+                                       const char *data, const size_t *offsets,
+                                       size_t n, const char *mask, size_t masklen,
+                                       char *out)
+{
+  intersects_column_ctx_t ctx = { data, offsets, mask, masklen, out };
+  work_pool_run(pool, n, 4096, intersects_column_chunk, &ctx);
+}
+
+/************************************************************/
+
+eval_prog_t *eval_prog_new(unsigned int n_operands)
+{
+  eval_prog_t *prog = (eval_prog_t *)calloc(1, sizeof(eval_prog_t));
+  if (!prog)
+    return NULL;
+
+  prog->n_operands = n_operands;
+  for (unsigned int i = 0; i < EVAL_MAX_OPERANDS; i++)
+    prog->operand_reg[i] = -1;
+  return prog;
+}
+
+void eval_prog_free(eval_prog_t *prog)
+{
+  free(prog->buf);
+  free(prog);
+}
+
+/* parser state */
+typedef struct eval_parser
+{
+  eval_prog_t *prog;
+  const char *pos;
+  const char *end;
+  char *message;
+  unsigned int depth;  /* parentheses and ~ currently open */
+} eval_parser_t;
+
+/*
+ * A parsed subexpression: the register holding its value, and
+ * whether that value still has to be complemented. Negations are
+ * kept pending so that "x & ~y" compiles to a single ANDNOT.
+ */
+typedef struct eval_val
+{
+  int reg;
+  bool negated;
+} eval_val_t;
+
+static int eval_emit(eval_parser_t *p, unsigned char op, int a, int b)
+{
+  eval_prog_t *prog = p->prog;
+  if (prog->n_insns >= EVAL_MAX_INSNS)
+  {
+    strcpy(p->message, "BITSET_EVAL expression is too complex");
+    return -1;
+  }
+
+  eval_insn_t *insn = &prog->insns[prog->n_insns];
+  insn->op = op;
+  insn->dst = prog->n_insns;
+  insn->a = a;
+  insn->b = b;
+  return prog->n_insns++;
+}
+
+static int eval_materialize(eval_parser_t *p, eval_val_t v)
+{
+  if (!v.negated)
+    return v.reg;
+  return eval_emit(p, EVAL_NOT, v.reg, 0);
+}
+
+static void eval_skip_space(eval_parser_t *p)
+{
+  while (p->pos < p->end &&
+         (*p->pos == ' ' || *p->pos == '\t' || *p->pos == '\n' || *p->pos == '\r'))
+    p->pos++;
+}
+
+/*
+ * Recursive descent, loosest binding last: | then ^ then & then ~ and
+ * parentheses. Each returns false after leaving an error in p->message.
+ */
+static bool eval_parse_or(eval_parser_t *p, eval_val_t *out);
+
+static bool eval_parse_unary(eval_parser_t *p, eval_val_t *out)
+{
+  eval_skip_space(p);
+  if (p->pos >= p->end)
+  {
+    strcpy(p->message, "BITSET_EVAL: unexpected end of expression");
+    return false;
+  }
+
+  char c = *p->pos;
+  if ((c == '~' || c == '(') && p->depth >= EVAL_MAX_DEPTH)
+  {
+    /* neither emits an instruction, so EVAL_MAX_INSNS doesn't bound them */
+    strcpy(p->message, "BITSET_EVAL expression is nested too deeply");
+    return false;
+  }
+
+  if (c == '~')
+  {
+    p->pos++;
+    p->depth++;
+    bool ok = eval_parse_unary(p, out);
+    p->depth--;
+    if (!ok)
+      return false;
+    out->negated = !out->negated;
+    return true;
+  }
+
+  if (c == '(')
+  {
+    p->pos++;
+    p->depth++;
+    bool ok = eval_parse_or(p, out);
+    p->depth--;
+    if (!ok)
+      return false;
+    eval_skip_space(p);
+    if (p->pos >= p->end || *p->pos != ')')
+    {
+      strcpy(p->message, "BITSET_EVAL: expected ')'");
+      return false;
+    }
+    p->pos++;
+    return true;
+  }
+
+  if (c >= 'A' && c <= 'Z')
+    c += 'a' - 'A';
+  if (c >= 'a' && c <= 'z')
+  {
+    unsigned int operand = c - 'a';
+    p->pos++;
+    if (operand >= p->prog->n_operands)
+    {
+      strcpy(p->message, "BITSET_EVAL expression refers to a missing argument");
+      return false;
+    }
+
+    /* load each operand once no matter how often it is referenced */
+    int reg = p->prog->operand_reg[operand];
+    if (reg < 0)
+    {
+      if ((reg = eval_emit(p, EVAL_LOAD, operand, 0)) < 0)
+        return false;
+      p->prog->operand_reg[operand] = reg;
+    }
+    out->reg = reg;
+    out->negated = false;
+    return true;
+  }
+
+  strcpy(p->message, "BITSET_EVAL: unexpected character in expression");
+  return false;
+}
+
+static bool eval_parse_and(eval_parser_t *p, eval_val_t *out)
+{
+  if (!eval_parse_unary(p, out))
+    return false;
+
+  for (;;)
+  {
+    eval_skip_space(p);
+    if (p->pos >= p->end || *p->pos != '&')
+      return true;
+    p->pos++;
+
+    eval_val_t rhs;
+    if (!eval_parse_unary(p, &rhs))
+      return false;
+
+    int reg;
+    if (out->negated && rhs.negated)
+    {
+      /* ~x & ~y == ~(x | y) */
+      reg = eval_emit(p, EVAL_OR, out->reg, rhs.reg);
+      out->negated = true;
+    }
+    else
+    {
+      if (out->negated)
+        reg = eval_emit(p, EVAL_ANDNOT, rhs.reg, out->reg);
+      else if (rhs.negated)
+        reg = eval_emit(p, EVAL_ANDNOT, out->reg, rhs.reg);
+      else
+        reg = eval_emit(p, EVAL_AND, out->reg, rhs.reg);
+      out->negated = false;
+    }
+
+    if (reg < 0)
+      return false;
+    out->reg = reg;
+  }
+}
+
+static bool eval_parse_xor(eval_parser_t *p, eval_val_t *out)
+{
+  if (!eval_parse_and(p, out))
+    return false;
+
+  for (;;)
+  {
+    eval_skip_space(p);
+    if (p->pos >= p->end || *p->pos != '^')
+      return true;
+    p->pos++;
+
+    eval_val_t rhs;
+    if (!eval_parse_and(p, &rhs))
+      return false;
+
+    /* ~x ^ y == ~(x ^ y), so the negations just cancel out */
+    int reg = eval_emit(p, EVAL_XOR, out->reg, rhs.reg);
+    if (reg < 0)
+      return false;
+    out->reg = reg;
+    out->negated = (out->negated != rhs.negated);
+  }
+}
+
+static bool eval_parse_or(eval_parser_t *p, eval_val_t *out)
+{
+  if (!eval_parse_xor(p, out))
+    return false;
+
+  for (;;)
+  {
+    eval_skip_space(p);
+    if (p->pos >= p->end || *p->pos != '|')
+      return true;
+    p->pos++;
+
+    eval_val_t rhs;
+    if (!eval_parse_xor(p, &rhs))
+      return false;
+
+    int a = eval_materialize(p, *out);
+    int b = (a < 0) ? -1 : eval_materialize(p, rhs);
+    if (b < 0)
+      return false;
+
+    int reg = eval_emit(p, EVAL_OR, a, b);
+    if (reg < 0)
+      return false;
+    out->reg = reg;
+    out->negated = false;
+  }
+}
+
+bool eval_prog_compile(eval_prog_t *prog, const char *expr, size_t len,
+                       char *message)
+{
+  eval_parser_t p;
+  p.prog = prog;
+  p.pos = expr;
+  p.end = expr + len;
+  p.message = message;
+  p.depth = 0;
+
+  eval_val_t result;
+  if (!eval_parse_or(&p, &result))
+    return false;
+
+  eval_skip_space(&p);
+  if (p.pos != p.end)
+  {
+    strcpy(message, "BITSET_EVAL: trailing characters in expression");
+    return false;
+  }
+
+  int reg = eval_materialize(&p, result);
+  if (reg < 0)
+    return false;
+  prog->result_reg = reg;
+  return true;
+}
+
+static void eval_load_block(unsigned long long *dst, const char *data,
+                            size_t datalen, size_t offset)
+{
+  if (offset + EVAL_BLOCK_BYTES <= datalen)
+  {
+    memcpy(dst, data + offset, EVAL_BLOCK_BYTES);
+    return;
+  }
+
+  memset(dst, 0, EVAL_BLOCK_BYTES);
+  if (offset < datalen)
+    memcpy(dst, data + offset, datalen - offset);
+}
+
+unsigned long long eval_prog_run(eval_prog_t *prog,
+                                 const char *const *operands,
+                                 const unsigned long *lens,
+                                 size_t len, bool stop_on_nonzero)
+{
+  unsigned long long regs[EVAL_MAX_INSNS][EVAL_BLOCK_WORDS];
+  unsigned long long count = 0;
+
+  for (size_t offset = 0; offset < len; offset += EVAL_BLOCK_BYTES)
+  {
+    for (unsigned int i = 0; i < prog->n_insns; i++)
+    {
+      const eval_insn_t *insn = &prog->insns[i];
+      unsigned long long *d = regs[insn->dst];
+      const unsigned long long *a = regs[insn->a];
+      const unsigned long long *b = regs[insn->b];
+
+      switch (insn->op)
+      {
+      case EVAL_LOAD:
+        eval_load_block(d, operands[insn->a], lens[insn->a], offset);
+        break;
+      case EVAL_AND:
+        for (unsigned int w = 0; w < EVAL_BLOCK_WORDS; w++) d[w] = a[w] & b[w];
+        break;
+      case EVAL_OR:
+        for (unsigned int w = 0; w < EVAL_BLOCK_WORDS; w++) d[w] = a[w] | b[w];
+        break;
+      case EVAL_XOR:
+        for (unsigned int w = 0; w < EVAL_BLOCK_WORDS; w++) d[w] = a[w] ^ b[w];
+        break;
+      case EVAL_ANDNOT:
+        for (unsigned int w = 0; w < EVAL_BLOCK_WORDS; w++) d[w] = a[w] & ~b[w];
+        break;
+      case EVAL_NOT:
+        for (unsigned int w = 0; w < EVAL_BLOCK_WORDS; w++) d[w] = ~a[w];
+        break;
+      }
+    }
+
+    unsigned long long *res = regs[prog->result_reg];
+    size_t nbytes = len - offset;
+    if (nbytes < EVAL_BLOCK_BYTES)
+      memset((char *)res + nbytes, 0, EVAL_BLOCK_BYTES - nbytes);
+    else
+      nbytes = EVAL_BLOCK_BYTES;
+
+    memcpy(prog->buf + offset, res, nbytes);
+    for (unsigned int w = 0; w < EVAL_BLOCK_WORDS; w++)
+      count += __builtin_popcountll(res[w]);
+
+    if (stop_on_nonzero && count)
+      break;
+  }
+
+  return count;
+}
+
+bool eval_prog_reserve(eval_prog_t *prog, size_t len)
+{
+  if (len <= prog->buf_len)
+    return true;
+
+  unsigned char *buf = (unsigned char *)realloc(prog->buf, len);
+  if (!buf)
+    return false;
+  prog->buf = buf;
+  prog->buf_len = len;
+  return true;
+}
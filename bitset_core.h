@@ -0,0 +1,289 @@
+#ifndef BITSET_CORE_H
+#define BITSET_CORE_H
+
+/**
+ * Bitset logic shared by the BITSET_* UDFs, usable outside of MySQL.
+ *
+ * A bitset is a little-endian string of bytes: bit n lives in byte n/8,
+ * at position n%8. Bitsets of different lengths may be combined; the
+ * missing bytes of the shorter one are treated as zero, with one
+ * exception kept for compatibility: bitset_and_data/bitset_and_view
+ * (and so BITSET_AND) leave the bytes of bs past the end of the
+ * shorter operand unchanged, as if it were padded with ones.
+ * BITSET_EVAL zero-pads, so when b is shorter than a,
+ * BITSET_EVAL('a & b', a, b) drops the bits of a past the end of b
+ * while BITSET_AND(a, b) keeps them.
+ *
+ * Nothing here depends on the MySQL headers, so batch jobs can link
+ * libudf_core.a directly. The batch functions work on whole columns at
+ * once; the *_parallel variants split the column across a work_pool_t
+ * (see work_pool.h) and are safe to call from several threads.
+ */
+
+#include <stddef.h>
+#include "work_pool.h"
+
+/* bitset is always a multiple of this number of bytes */
+#define CHUNK_SIZE 8
+#define MAX_SIZE 128
+
+typedef struct bitset
+{
+  size_t len;
+  size_t max_len;
+  unsigned char *data;
+} bitset_t;
+
+bitset_t *bitset_new(size_t initial_len, size_t max_len);
+void bitset_free(bitset_t *bs);
+void bitset_clear(bitset_t *bs);
+bool bitset_ensure_len(bitset_t *bs, size_t len);
+void bitset_set(bitset_t *bs, size_t bit);
+void bitset_or_data(bitset_t *bs, const char *data, size_t datalen);
+/* only touches the first datalen bytes of bs, see above */
+void bitset_and_data(bitset_t *bs, const char *data, size_t datalen);
+
+/*
+ * Kernels specialized for a fixed bitset width of 8, 16, 32, 64 or 128
+ * bytes. They work on whole words with no length checks or resizing,
+ * so callers that know the width up front (e.g. from a constant
+ * argument) can pick them once and fall back to the generic functions
+ * when a value doesn't have exactly that width.
+ */
+typedef struct bitset_kernels
+{
+  size_t width;
+
+  /* src and dst are exactly width bytes */
+  void (*or_into)(unsigned char *dst, const char *src);
+  void (*and_into)(unsigned char *dst, const char *src);
+  bool (*intersects)(const char *a, const char *b);
+} bitset_kernels_t;
+
+/* kernels for the smallest width of at least len, or NULL if len > 128 */
+const bitset_kernels_t *bitset_kernels_for(size_t len);
+
+/************************************************************/
+
+/*
+ * Summarized bitsets.
+ *
+ * A summarized bitset is a plain bitset with a 16 byte header in
+ * front:
+ *
+ *   bytes 0-3    magic: 0xff 'B' 'S' 0x01
+ *   bytes 4-7    number of bits set (little-endian)
+ *   bytes 8-15   summary mask (little-endian): bit k is set if any bit
+ *                in data bytes [16k, 16k + 16) is set. Bit 63 covers
+ *                everything from byte 1008 onwards.
+ *
+ * Any string of bytes is a valid plain bitset, the magic included, so
+ * the encoding is never guessed from the data: bitset_view_init()
+ * always reads a plain bitset and bitset_view_init_summarized() a
+ * summarized one, and callers pick based on what they were given (the
+ * *_SUMMARIZED UDFs take summarized bitsets, everything else plain
+ * ones). Comparing two summaries lets intersects reject most disjoint
+ * pairs without looking at the data, and skip the empty blocks
+ * otherwise.
+ */
+
+#define BITSET_SUMMARY_HEADER_LEN 16
+#define BITSET_SUMMARY_BLOCK 16
+#define BITSET_SUMMARY_BLOCKS 64
+
+typedef struct bitset_view
+{
+  const char *data;   /* the plain bytes, past any header */
+  size_t len;
+  bool has_summary;
+  unsigned long long summary;  /* all ones for a plain bitset */
+  unsigned int count;          /* only valid if has_summary */
+} bitset_view_t;
+
+/* views a plain bitset; data may be NULL, giving an empty view */
+void bitset_view_init(bitset_view_t *v, const char *data, size_t len);
+
+/*
+ * Views a summarized bitset. Returns false if data doesn't start with
+ * a header that is consistent with the bytes after it.
+ */
+bool bitset_view_init_summarized(bitset_view_t *v, const char *data, size_t len);
+
+/*
+ * Writes the summarized encoding of the plain bitset to out, which
+ * needs room for BITSET_SUMMARY_HEADER_LEN + len bytes. Returns the
+ * encoded length.
+ */
+size_t bitset_summarize(const char *data, size_t len, char *out);
+
+void bitset_or_view(bitset_t *bs, const bitset_view_t *v);
+void bitset_and_view(bitset_t *bs, const bitset_view_t *v);
+
+/* true if a & b is nonzero */
+bool bitset_intersects_view(const bitset_view_t *a, const bitset_view_t *b);
+bool bitset_intersects_data(const char *a, size_t alen,
+                            const char *b, size_t blen);
+
+/* true if every bit set in b is also set in a */
+bool bitset_contains_view(const bitset_view_t *a, const bitset_view_t *b);
+
+/* number of bits set below bit i */
+unsigned long long bitset_rank(const bitset_view_t *v, unsigned long long i);
+
+/*
+ * Position of the n-th set bit, counting from 0, or -1 if fewer than
+ * n + 1 bits are set. bitset_select(v, bitset_rank(v, i)) == i for
+ * every bit i that is set.
+ */
+long long bitset_select(const bitset_view_t *v, unsigned long long n);
+
+/************************************************************/
+
+/*
+ * Bit-sliced indexes (BSI_*).
+ *
+ * A BSI stores an unsigned value of up to 64 bits per id as one bitset
+ * per value bit plus a bitset of the ids present, all laid out like
+ * BITSET_AGGREGATE results and padded to the same length:
+ *
+ *   bytes 0-3    magic: 'B' 'S' 'I' 0x01
+ *   byte 4       number of value bits
+ *   bytes 5-7    zero
+ *   bytes 8-11   slice length in bytes (little-endian)
+ *   then         the existence slice, followed by the slice for value
+ *                bit 0, bit 1, ... up to the top bit
+ *
+ * Range and sum queries combine the slices a word at a time, so they
+ * cost O(bits * words) no matter how many ids are present.
+ */
+
+#define BSI_HEADER_LEN 12
+#define BSI_MAX_BITS 64
+#define BSI_MAX_WIDTH (1 << 20)   /* bytes per slice */
+
+typedef struct bsi_view
+{
+  unsigned int bits;
+  size_t slice_len;
+  const char *exists;
+  const char *slices;   /* slice i starts at slices + i * slice_len */
+} bsi_view_t;
+
+/* returns false if data is not a well-formed BSI */
+bool bsi_view_init(bsi_view_t *v, const char *data, size_t len);
+
+size_t bsi_encoded_len(unsigned int bits, size_t slice_len);
+void bsi_write_header(char *out, unsigned int bits, size_t slice_len);
+
+/*
+ * Writes to out (slice_len bytes) the bitset of ids whose value is
+ * between lo and hi inclusive.
+ */
+void bsi_range(const bsi_view_t *v, unsigned long long lo,
+               unsigned long long hi, char *out);
+
+/* sum of the values of the ids in filter, or of all ids if it is NULL */
+unsigned long long bsi_sum(const bsi_view_t *v, const bitset_view_t *filter);
+
+/*
+ * Intersects each of n bitsets against mask: out[i] is set to 1 if
+ * bitsets[i] intersects the mask and 0 otherwise (including when
+ * bitsets[i] is NULL).
+ */
+void bitset_intersects_batch(const char *const *bitsets, const size_t *lens,
+                             size_t n, const char *mask, size_t masklen,
+                             char *out);
+
+/*
+ * Same as bitset_intersects_batch, for a column stored contiguously:
+ * row i occupies data[offsets[i]] up to data[offsets[i + 1]], so
+ * offsets has n + 1 entries.
+ */
+void bitset_intersects_column(const char *data, const size_t *offsets,
+                              size_t n, const char *mask, size_t masklen,
+                              char *out);
+void bitset_intersects_column_parallel(work_pool_t *pool,
+                                       const char *data, const size_t *offsets,
+                                       size_t n, const char *mask, size_t masklen,
+                                       char *out);
+
+/************************************************************/
+
+/*
+ * Compiled bitset expressions (BITSET_EVAL).
+ *
+ * The operands are named a, b, c, ... and may be combined with & | ^ ~
+ * and parentheses. An expression is compiled once into a small
+ * register program, which is then evaluated a block of words at a
+ * time: every instruction runs across the whole block before the next
+ * one, so all the operands are read exactly once and the result is
+ * written into a single buffer that is reused between evaluations.
+ *
+ * A compiled program is immutable except for its output buffer, so
+ * concurrent evaluations each need their own eval_prog_t.
+ */
+
+/* number of 64-bit words processed per instruction */
+#define EVAL_BLOCK_WORDS 8
+#define EVAL_BLOCK_BYTES (EVAL_BLOCK_WORDS * 8)
+#define EVAL_MAX_INSNS 64
+#define EVAL_MAX_OPERANDS 26
+#define EVAL_MAX_DEPTH 64   /* nested parentheses and ~ */
+
+enum eval_opcode
+{
+  EVAL_LOAD,    /* dst = operand a */
+  EVAL_AND,     /* dst = a & b */
+  EVAL_OR,      /* dst = a | b */
+  EVAL_XOR,     /* dst = a ^ b */
+  EVAL_ANDNOT,  /* dst = a & ~b */
+  EVAL_NOT      /* dst = ~a */
+};
+
+typedef struct eval_insn
+{
+  unsigned char op;
+  unsigned char dst;
+  unsigned char a;  /* source register, or operand index for EVAL_LOAD */
+  unsigned char b;
+} eval_insn_t;
+
+typedef struct eval_prog
+{
+  unsigned int n_insns;
+  unsigned int n_operands;
+  unsigned int result_reg;
+  eval_insn_t insns[EVAL_MAX_INSNS];
+  int operand_reg[EVAL_MAX_OPERANDS];  /* register holding each loaded operand */
+
+  /* output buffer, reused between evaluations */
+  unsigned char *buf;
+  size_t buf_len;
+} eval_prog_t;
+
+eval_prog_t *eval_prog_new(unsigned int n_operands);
+void eval_prog_free(eval_prog_t *prog);
+
+/*
+ * Compiles expr into prog. On failure returns false and leaves an
+ * error in message, which should have room for at least 80 bytes.
+ */
+bool eval_prog_compile(eval_prog_t *prog, const char *expr, size_t len,
+                       char *message);
+
+/* grows the output buffer to hold at least len bytes */
+bool eval_prog_reserve(eval_prog_t *prog, size_t len);
+
+/*
+ * Evaluates the program over the given operands, producing len bytes
+ * of result in prog->buf (which must have room for len rounded up to
+ * EVAL_BLOCK_BYTES). If stop_on_nonzero is set, stops at the first
+ * block with a bit set, leaving the buffer only partially filled.
+ * Returns the number of bits set in the (possibly partial) result.
+ */
+unsigned long long eval_prog_run(eval_prog_t *prog,
+                                 const char *const *operands,
+                                 const unsigned long *lens,
+                                 size_t len, bool stop_on_nonzero);
+
+#endif
@@ -1,16 +1,42 @@
 drop function bitset_aggregate;
+drop function bsi_aggregate;
 drop function bitset_or;
 drop function bitset_and;
 drop function bitset_create;
 drop function bitset_intersects;
+drop function bitset_contains;
+drop function bitset_rank;
+drop function bitset_nth;
+drop function bitset_summarize;
+drop function bitset_plain;
+drop function bitset_intersects_summarized;
+drop function bitset_contains_summarized;
+drop function bsi_range;
+drop function bsi_sum;
+drop function bitset_eval;
+drop function bitset_eval_count;
+drop function bitset_eval_any;
 
 \! cp /home/todd/val_limit_udf/libudf_bitset.so /usr/lib/
 
 create aggregate function  bitset_aggregate returns string soname 'libudf_bitset.so';
+create aggregate function bsi_aggregate returns string soname 'libudf_bitset.so';
 create function bitset_or returns string soname 'libudf_bitset.so';
 create function bitset_and returns string soname 'libudf_bitset.so';
 create function bitset_create returns string soname 'libudf_bitset.so';
 create function bitset_intersects returns integer soname 'libudf_bitset.so';
+create function bitset_contains returns integer soname 'libudf_bitset.so';
+create function bitset_rank returns integer soname 'libudf_bitset.so';
+create function bitset_nth returns integer soname 'libudf_bitset.so';
+create function bitset_summarize returns string soname 'libudf_bitset.so';
+create function bitset_plain returns string soname 'libudf_bitset.so';
+create function bitset_intersects_summarized returns integer soname 'libudf_bitset.so';
+create function bitset_contains_summarized returns integer soname 'libudf_bitset.so';
+create function bsi_range returns string soname 'libudf_bitset.so';
+create function bsi_sum returns integer soname 'libudf_bitset.so';
+create function bitset_eval returns string soname 'libudf_bitset.so';
+create function bitset_eval_count returns integer soname 'libudf_bitset.so';
+create function bitset_eval_any returns integer soname 'libudf_bitset.so';
 
 drop temporary table if exists ag_bitsets;
 create temporary table ag_bitsets as select album_id, bitset_aggregate(genre_id, 22) bs from AlbumGenre group by album_id;
@@ -26,3 +52,31 @@ set @bsb := (select bitset_aggregate(id, 22) from Genre where id < 80);
 
 select hex(@bsa), hex(@bsb), hex(bitset_or(@bsa, @bsb))\G
 select hex(@bsa), hex(@bsb), hex(bitset_and(@bsa, @bsb))\G
+
+set @bsc = bitset_create(2,5,7);
+select hex(bitset_eval('(a & (b | c)) & ~d', @bsa, @bsb, @bsc, bitset_create(1))),
+       bitset_eval_count('a ^ b', @bsa, @bsb),
+       bitset_eval_any('a & ~b', @bsa, @bsb)\G
+
+set @sa = bitset_summarize(@bsa);
+set @sb = bitset_summarize(@bsb);
+-- bitset_plain(@sa) should equal @bsa; the last two should be NULL
+select hex(@sa), hex(bitset_plain(@sa)) = hex(@bsa), bitset_intersects_summarized(@sa, @sb),
+       bitset_contains_summarized(@sa, bitset_summarize(bitset_create(81))),
+       bitset_intersects_summarized(@sa, @bsb), bitset_plain(@bsa)\G
+
+-- a plain bitset that starts with the summary magic; should give 1, 0, 17
+set @magic = bitset_create(0,1,2,3,4,5,6,7,9,14,16,17,20,22,24,100,170);
+select bitset_intersects(@magic, bitset_create(0)), bitset_nth(@magic, 1),
+       bitset_rank(@magic, 171)\G
+
+select bitset_rank(@bsa, 90), bitset_nth(@bsa, 1), bitset_nth(@bsa, bitset_rank(@bsa, 90) + 1),
+       bitset_nth(bitset_plain(@sa), 2), bitset_nth(bitset_create(1,2,3), 4)\G
+
+-- each pair should match: the BSI against the same query done row by row
+set @bsi := (select bsi_aggregate(id, id * 3, 10, 22) from Genre);
+select bitset_eval_count('a ^ b', bsi_range(@bsi, 30, 90),
+                         (select bitset_aggregate(id, 22) from Genre where id * 3 between 30 and 90)), 0,
+       bsi_sum(@bsi), (select sum(id * 3) from Genre where id < 176),
+       bsi_sum(@bsi, bsi_range(@bsi, 30, 90)), (select sum(id * 3) from Genre where id * 3 between 30 and 90),
+       bsi_sum(@bsi, bitset_create(1, 2, 3)), (select sum(id * 3) from Genre where id in (1, 2, 3))\G
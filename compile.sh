@@ -1,5 +1,14 @@
 #!/bin/sh
 
-g++ -O3 -Wall -fPIC -shared -o libval_limit.so -I/usr/include/mysql val_limit.cc 2>&1
-g++ -O3 -Wall -fPIC -shared -o libudf_bitset.so -I/usr/include/mysql bitset.cc 2>&1
+# core library, usable without MySQL
+g++ -O3 -Wall -fPIC -c -o bitset_core.o bitset_core.cc 2>&1
+g++ -O3 -Wall -fPIC -c -o val_limit_core.o val_limit_core.cc 2>&1
+g++ -O3 -Wall -fPIC -c -o val_limit_global.o val_limit_global.cc 2>&1
+g++ -O3 -Wall -fPIC -c -o work_pool.o work_pool.cc 2>&1
+ar rcs libudf_core.a bitset_core.o val_limit_core.o val_limit_global.o work_pool.o
 
+g++ -O3 -Wall -fPIC -shared -o libval_limit.so -I/usr/include/mysql val_limit.cc libudf_core.a -lpthread 2>&1
+g++ -O3 -Wall -fPIC -shared -o libudf_bitset.so -I/usr/include/mysql bitset.cc libudf_core.a -lpthread 2>&1
+
+# checks for the core library: ./core_test
+g++ -O2 -Wall -o core_test core_test.cc libudf_core.a -lpthread 2>&1
@@ -0,0 +1,546 @@
+/**
+ * Checks for libudf_core.a that run without MySQL.
+ *
+ *  g++ -O2 -Wall -o core_test core_test.cc libudf_core.a -lpthread
+ *  ./core_test
+ *
+ * Prints each failed check and exits non-zero if there were any.
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bitset_core.h"
+#include "val_limit_core.h"
+#include "val_limit_global.h"
+
+static int failures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) \
+    { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while (0)
+
+/************************************************************/
+
+#define GLOBAL_THREADS 8
+#define GLOBAL_VALUES 1000
+#define GLOBAL_LIMIT 5
+
+static val_limit_ns_t *global_ns;
+static int global_accepted[GLOBAL_VALUES];
+
+static void *global_thread(void *arg)
+{
+  for (int round = 0; round < 20; round++)
+  {
+    for (int v = 0; v < GLOBAL_VALUES; v++)
+    {
+      int res = val_limit_ns_add(global_ns, v * 7919LL, GLOBAL_LIMIT);
+      if (res > 0)
+        __atomic_add_fetch(&global_accepted[v], 1, __ATOMIC_RELAXED);
+      else if (res < 0)
+        __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+    }
+  }
+  return NULL;
+}
+
+static void test_val_limit_global()
+{
+  char message[128];
+
+  /* concurrent writers accept exactly limit occurrences of each value */
+  global_ns = val_limit_ns_acquire("test", 4, 0, GLOBAL_VALUES, message);
+  CHECK(global_ns != NULL);
+  if (!global_ns)
+    return;
+
+  pthread_t threads[GLOBAL_THREADS];
+  for (int i = 0; i < GLOBAL_THREADS; i++)
+    pthread_create(&threads[i], NULL, global_thread, NULL);
+  for (int i = 0; i < GLOBAL_THREADS; i++)
+    pthread_join(threads[i], NULL);
+  for (int v = 0; v < GLOBAL_VALUES; v++)
+    CHECK(global_accepted[v] == GLOBAL_LIMIT);
+
+  /* oversized namespaces are refused rather than sized */
+  CHECK(val_limit_ns_acquire("huge", 4, 0, (size_t)-1, message) == NULL);
+  CHECK(val_limit_ns_acquire("huge", 4, UINT_MAX, 0, message) == NULL);
+
+  /* a namespace can't be reopened with a different ttl */
+  CHECK(val_limit_ns_acquire("test", 4, 60, 0, message) == NULL);
+
+  /* a reset expires the counts, even while the namespace is held */
+  CHECK(val_limit_ns_reset("test", 4) == 1);
+  CHECK(val_limit_ns_add(global_ns, 0, 1) == 1);
+  CHECK(val_limit_ns_add(global_ns, 0, 1) == 0);
+
+  val_limit_ns_release(global_ns);
+  CHECK(val_limit_ns_reset("test", 4) == 0);
+  CHECK(val_limit_ns_reset("none", 4) == -1);
+
+  /*
+   * Slots of expired counts are reused, so a held namespace keeps
+   * accepting new values across generations.
+   */
+  val_limit_ns_t *ns = val_limit_ns_acquire("small", 5, 0, 1000, message);
+  CHECK(ns != NULL);
+  if (!ns)
+    return;
+
+  int errors = 0;
+  for (int gen = 0; gen < 10; gen++)
+  {
+    for (int i = 0; i < 1000; i++)
+    {
+      long long val = gen * 1000 + i;
+      if (val_limit_ns_add(ns, val, 1) != 1 || val_limit_ns_add(ns, val, 1) != 0)
+        errors++;
+    }
+    val_limit_ns_reset("small", 5);
+  }
+  CHECK(errors == 0);
+  val_limit_ns_release(ns);
+}
+
+/************************************************************/
+
+#define BATCH_ROWS 100000
+
+/* the batch and parallel entry points agree with the serial ones */
+static void test_batch(work_pool_t *pool)
+{
+  long long *vals = (long long *)malloc(BATCH_ROWS * sizeof(long long));
+  char *nulls = (char *)malloc(BATCH_ROWS);
+  char *expected = (char *)malloc(BATCH_ROWS);
+  char *out = (char *)malloc(BATCH_ROWS);
+  size_t *offsets = (size_t *)malloc((BATCH_ROWS + 1) * sizeof(size_t));
+  char *data = (char *)malloc(BATCH_ROWS * 20);
+
+  srand(1);
+  size_t len = 0;
+  for (size_t i = 0; i < BATCH_ROWS; i++)
+  {
+    vals[i] = rand() % 5000;
+    nulls[i] = rand() % 50 == 0;
+
+    offsets[i] = len;
+    for (int j = rand() % 20; j > 0; j--)
+      data[len++] = (rand() % 8 == 0) ? (char)(1 << (rand() % 8)) : 0;
+  }
+  offsets[BATCH_ROWS] = len;
+
+  char mask[16];
+  memset(mask, 0, sizeof(mask));
+  mask[3] = 0x10;
+  mask[7] = 0x01;
+
+  for (size_t i = 0; i < BATCH_ROWS; i++)
+    expected[i] = bitset_intersects_data(data + offsets[i], offsets[i + 1] - offsets[i],
+                                         mask, sizeof(mask));
+  bitset_intersects_column(data, offsets, BATCH_ROWS, mask, sizeof(mask), out);
+  CHECK(memcmp(out, expected, BATCH_ROWS) == 0);
+  memset(out, 2, BATCH_ROWS);
+  bitset_intersects_column_parallel(pool, data, offsets, BATCH_ROWS, mask, sizeof(mask), out);
+  CHECK(memcmp(out, expected, BATCH_ROWS) == 0);
+
+  val_limit_t *serial = val_limit_new(7, 1);
+  for (size_t i = 0; i < BATCH_ROWS; i++)
+    expected[i] = nulls[i] ? 1 : val_limit_add(serial, vals[i]);
+  val_limit_free(serial);
+
+  val_limit_t *batch = val_limit_new(7, 1);
+  CHECK(val_limit_batch(batch, vals, nulls, BATCH_ROWS, out));
+  CHECK(memcmp(out, expected, BATCH_ROWS) == 0);
+  val_limit_free(batch);
+
+  val_limit_t *parallel = val_limit_new(7, 64);
+  memset(out, 2, BATCH_ROWS);
+  CHECK(val_limit_batch_parallel(pool, parallel, vals, nulls, BATCH_ROWS, out));
+  CHECK(memcmp(out, expected, BATCH_ROWS) == 0);
+  val_limit_free(parallel);
+
+  free(data);
+  free(offsets);
+  free(out);
+  free(expected);
+  free(nulls);
+  free(vals);
+}
+
+/************************************************************/
+
+#define SAMPLE_ROWS 200000
+#define SAMPLE_VALUES 20000
+
+static void test_val_sample()
+{
+  /* about rate of the rows are kept */
+  val_sample_t vs;
+  val_sample_setup(&vs, 0.1, 42);
+  long kept = 0;
+  for (long i = 0; i < SAMPLE_ROWS; i++)
+    kept += val_sample_keep(&vs, i % SAMPLE_VALUES, i);
+  CHECK(kept > SAMPLE_ROWS * 0.09 && kept < SAMPLE_ROWS * 0.11);
+
+  /* the same seed and salts keep the same rows, whatever the order */
+  long same = 0;
+  for (long i = SAMPLE_ROWS - 1; i >= 0; i--)
+    same += val_sample_keep(&vs, i % SAMPLE_VALUES, i);
+  CHECK(same == kept);
+  for (long i = 0; i < 1000; i++)
+  {
+    val_sample_t again;
+    val_sample_setup(&again, 0.1, 42);
+    CHECK(val_sample_keep(&again, i, i * 7) == val_sample_keep(&vs, i, i * 7));
+  }
+
+  val_sample_setup(&vs, 1.0, 0);
+  CHECK(val_sample_keep(&vs, 1, 2));
+  val_sample_setup(&vs, 0.0, 0);
+  CHECK(!val_sample_keep(&vs, 1, 2));
+
+  /* never more than limit rows per value, and few values left short */
+  val_sample_limit_t vsl;
+  CHECK(val_sample_limit_init(&vsl, SAMPLE_VALUES));
+  if (!vsl.counts)
+    return;
+  val_sample_limit_setup(&vsl, 1.0, 3, 7);
+
+  int *counts = (int *)calloc(SAMPLE_VALUES, sizeof(int));
+  for (long i = 0; i < SAMPLE_ROWS; i++)
+  {
+    long val = (i * 7919) % SAMPLE_VALUES;
+    if (val_sample_limit_keep(&vsl, val, i))
+      counts[val]++;
+  }
+
+  int over = 0, short_values = 0;
+  for (int v = 0; v < SAMPLE_VALUES; v++)
+  {
+    if (counts[v] > 3)
+      over++;
+    if (counts[v] < 3)
+      short_values++;
+  }
+  CHECK(over == 0);
+  CHECK(short_values < SAMPLE_VALUES / 20);
+
+  free(counts);
+  val_sample_limit_free(&vsl);
+}
+
+/************************************************************/
+
+static void test_summary()
+{
+  /* a plain bitset that happens to start with the summary magic */
+  char plain[32];
+  memset(plain, 0, sizeof(plain));
+  bitset_summarize(plain, 16, plain);
+  CHECK((unsigned char)plain[0] == 0xff);
+
+  bitset_view_t v;
+  bitset_view_init(&v, plain, sizeof(plain));
+  CHECK(!v.has_summary && v.len == sizeof(plain));
+  CHECK(bitset_select(&v, 0) == 0);
+
+  /* summarized bitsets round-trip and agree with the plain functions */
+  char a[200], b[200], sa[216], sb[216];
+  srand(2);
+  for (int round = 0; round < 1000; round++)
+  {
+    size_t alen = rand() % sizeof(a), blen = rand() % sizeof(b);
+    for (size_t i = 0; i < alen; i++)
+      a[i] = (rand() % 16 == 0) ? (char)(1 << (rand() % 8)) : 0;
+    for (size_t i = 0; i < blen; i++)
+      b[i] = (rand() % 16 == 0) ? (char)(1 << (rand() % 8)) : 0;
+
+    size_t salen = bitset_summarize(a, alen, sa);
+    size_t sblen = bitset_summarize(b, blen, sb);
+
+    bitset_view_t pa, pb, va, vb;
+    bitset_view_init(&pa, a, alen);
+    bitset_view_init(&pb, b, blen);
+    CHECK(bitset_view_init_summarized(&va, sa, salen));
+    CHECK(bitset_view_init_summarized(&vb, sb, sblen));
+    CHECK(va.len == alen && memcmp(va.data, a, alen) == 0);
+    CHECK(bitset_intersects_view(&va, &vb) == bitset_intersects_view(&pa, &pb));
+    CHECK(bitset_contains_view(&va, &vb) == bitset_contains_view(&pa, &pb));
+  }
+
+  /* anything else is refused as a summarized bitset */
+  CHECK(!bitset_view_init_summarized(&v, a, 15));
+  CHECK(!bitset_view_init_summarized(&v, NULL, 0));
+  sa[4] ^= 1;
+  CHECK(!bitset_view_init_summarized(&v, sa, 16));
+}
+
+static unsigned long long rand64()
+{
+  return ((unsigned long long)rand() << 42) ^ ((unsigned long long)rand() << 21) ^ rand();
+}
+
+#define BSI_IDS 320
+
+/* bsi_range and bsi_sum agree with a value-by-value reference */
+static void test_bsi()
+{
+  static const unsigned int widths[] = { 1, 3, 10, 63, 64 };
+  unsigned long long values[BSI_IDS];
+  bool exists[BSI_IDS];
+  char bsi[BSI_HEADER_LEN + (BSI_MAX_BITS + 1) * (BSI_IDS / 8)];
+  char out[BSI_IDS / 8], filter[BSI_IDS / 8];
+
+  srand(3);
+  for (int round = 0; round < 200; round++)
+  {
+    unsigned int bits = widths[round % 5];
+    size_t slice_len = 1 + rand() % (BSI_IDS / 8);
+    size_t ids = slice_len * 8;
+    unsigned long long max = (bits == 64) ? ~0ULL : (1ULL << bits) - 1;
+
+    memset(bsi, 0, sizeof(bsi));
+    bsi_write_header(bsi, bits, slice_len);
+    char *slices = bsi + BSI_HEADER_LEN;
+    for (size_t id = 0; id < ids; id++)
+    {
+      /* small values repeat, so ranges have ties at both ends */
+      values[id] = (rand() % 2 ? rand() % 8 : rand64()) & max;
+      exists[id] = rand() % 4 != 0;
+      if (!exists[id])
+        continue;
+      slices[id / 8] |= 1 << (id % 8);
+      for (unsigned int i = 0; i < bits; i++)
+        if ((values[id] >> i) & 1)
+          slices[(i + 1) * slice_len + id / 8] |= 1 << (id % 8);
+    }
+
+    bsi_view_t v;
+    CHECK(bsi_view_init(&v, bsi, bsi_encoded_len(bits, slice_len)));
+    CHECK(!bsi_view_init(&v, bsi, bsi_encoded_len(bits, slice_len) - 1));
+    bsi_view_init(&v, bsi, bsi_encoded_len(bits, slice_len));
+
+    for (int q = 0; q < 20; q++)
+    {
+      unsigned long long lo = (q % 3 == 0) ? values[rand() % ids] : rand64() & max;
+      unsigned long long hi = (q % 3 == 1) ? values[rand() % ids] : rand64();
+      if (q % 4 == 0)
+        hi = lo + rand() % 4;
+
+      bsi_range(&v, lo, hi, out);
+      int errors = 0;
+      for (size_t id = 0; id < ids; id++)
+      {
+        bool in = exists[id] && values[id] >= lo && values[id] <= hi;
+        if (((out[id / 8] >> (id % 8)) & 1) != in)
+          errors++;
+      }
+      CHECK(errors == 0);
+    }
+
+    unsigned long long all = 0, filtered = 0;
+    size_t filter_len = rand() % (slice_len + 4);
+    if (filter_len > sizeof(filter))
+      filter_len = sizeof(filter);
+    for (size_t i = 0; i < filter_len; i++)
+      filter[i] = (char)rand();
+    for (size_t id = 0; id < ids; id++)
+    {
+      if (!exists[id])
+        continue;
+      all += values[id];
+      if (id / 8 < filter_len && ((filter[id / 8] >> (id % 8)) & 1))
+        filtered += values[id];
+    }
+
+    bitset_view_t f;
+    bitset_view_init(&f, filter, filter_len);
+    CHECK(bsi_sum(&v, NULL) == all);
+    CHECK(bsi_sum(&v, &f) == filtered);
+  }
+}
+
+#define EVAL_OPERANDS 4
+#define EVAL_LEN 150
+
+static const char *eval_operands[EVAL_OPERANDS];
+static unsigned long eval_lens[EVAL_OPERANDS];
+
+/* writes a random expression to expr */
+static void eval_random_expr(char **expr, int depth)
+{
+  int kind = (depth == 0) ? 0 : rand() % 5;
+  if (kind == 0)
+    *(*expr)++ = 'a' + rand() % EVAL_OPERANDS;
+  else if (kind == 1)
+  {
+    *(*expr)++ = '~';
+    eval_random_expr(expr, depth - 1);
+  }
+  else
+  {
+    *(*expr)++ = '(';
+    eval_random_expr(expr, depth - 1);
+    *(*expr)++ = " &|^"[kind - 1];
+    eval_random_expr(expr, depth - 1);
+    *(*expr)++ = ')';
+  }
+}
+
+/* value of bit n of the expression at *expr, zero-padding the operands */
+static bool eval_reference(const char **expr, size_t n)
+{
+  char c = *(*expr)++;
+  if (c == '~')
+    return !eval_reference(expr, n);
+  if (c != '(')
+  {
+    unsigned int i = c - 'a';
+    return n / 8 < eval_lens[i] && ((eval_operands[i][n / 8] >> (n % 8)) & 1);
+  }
+
+  bool a = eval_reference(expr, n);
+  char op = *(*expr)++;
+  bool b = eval_reference(expr, n);
+  (*expr)++;
+  return op == '&' ? (a && b) : op == '|' ? (a || b) : (a != b);
+}
+
+/* BITSET_EVAL agrees bit by bit with the expression, whatever the lengths */
+static void test_eval_reference()
+{
+  char data[EVAL_OPERANDS][EVAL_LEN];
+  char message[128];
+
+  srand(4);
+  for (int round = 0; round < 500; round++)
+  {
+    size_t len = 0;
+    for (int i = 0; i < EVAL_OPERANDS; i++)
+    {
+      eval_lens[i] = (rand() % 4 == 0) ? 0 : rand() % EVAL_LEN;
+      for (size_t j = 0; j < eval_lens[i]; j++)
+        data[i][j] = (char)rand();
+      eval_operands[i] = data[i];
+      if (eval_lens[i] > len)
+        len = eval_lens[i];
+    }
+
+    char expr[256];
+    char *end = expr;
+    eval_random_expr(&end, 4);
+
+    eval_prog_t *prog = eval_prog_new(EVAL_OPERANDS);
+    bool ok = eval_prog_compile(prog, expr, end - expr, message);
+    CHECK(ok);
+    if (!ok)
+    {
+      eval_prog_free(prog);
+      continue;
+    }
+
+    size_t blocks = (len + EVAL_BLOCK_BYTES - 1) / EVAL_BLOCK_BYTES;
+    CHECK(eval_prog_reserve(prog, blocks * EVAL_BLOCK_BYTES));
+    unsigned long long count = eval_prog_run(prog, eval_operands, eval_lens, len, false);
+
+    unsigned long long expected_count = 0;
+    int errors = 0;
+    for (size_t n = 0; n < len * 8; n++)
+    {
+      const char *pos = expr;
+      bool bit = eval_reference(&pos, n);
+      expected_count += bit;
+      if (((prog->buf[n / 8] >> (n % 8)) & 1) != bit)
+        errors++;
+    }
+    CHECK(errors == 0);
+    CHECK(count == expected_count);
+    eval_prog_free(prog);
+  }
+
+  /* unlike bitset_and_data, 'a & b' clears the bits of a past the end of b */
+  char a[16], b[8];
+  memset(a, 0xff, sizeof(a));
+  memset(b, 0xff, sizeof(b));
+  eval_operands[0] = a;
+  eval_operands[1] = b;
+  eval_lens[0] = sizeof(a);
+  eval_lens[1] = sizeof(b);
+
+  eval_prog_t *prog = eval_prog_new(2);
+  CHECK(eval_prog_compile(prog, "a & b", 5, message));
+  CHECK(eval_prog_reserve(prog, EVAL_BLOCK_BYTES));
+  CHECK(eval_prog_run(prog, eval_operands, eval_lens, sizeof(a), false) == 64);
+  eval_prog_free(prog);
+
+  bitset_t *bs = bitset_new(sizeof(a), sizeof(a));
+  bitset_or_data(bs, a, sizeof(a));
+  bitset_and_data(bs, b, sizeof(b));
+  CHECK(bs->data[sizeof(a) - 1] == 0xff);
+  bitset_free(bs);
+}
+
+static void test_eval_depth()
+{
+  char message[128];
+  char expr[2 * EVAL_MAX_DEPTH + 4];
+
+  /* EVAL_MAX_DEPTH levels of parentheses compile, one more doesn't */
+  for (unsigned int depth = EVAL_MAX_DEPTH; depth <= EVAL_MAX_DEPTH + 1; depth++)
+  {
+    memset(expr, '(', depth);
+    expr[depth] = 'a';
+    memset(expr + depth + 1, ')', depth);
+
+    eval_prog_t *prog = eval_prog_new(1);
+    bool ok = eval_prog_compile(prog, expr, 2 * depth + 1, message);
+    CHECK(ok == (depth == EVAL_MAX_DEPTH));
+    eval_prog_free(prog);
+  }
+
+  /* deep nesting is rejected before it can exhaust the stack */
+  size_t len = 1 << 20;
+  char *deep = (char *)malloc(len);
+  memset(deep, '~', len);
+  eval_prog_t *prog = eval_prog_new(1);
+  CHECK(!eval_prog_compile(prog, deep, len, message));
+  eval_prog_free(prog);
+  free(deep);
+}
+
+/************************************************************/
+
+int main()
+{
+  work_pool_t *pool = work_pool_new(4);
+  if (!pool)
+  {
+    fprintf(stderr, "couldn't start the work pool\n");
+    return 1;
+  }
+  test_batch(pool);
+  work_pool_free(pool);
+
+  test_summary();
+  test_bsi();
+  test_eval_reference();
+  test_eval_depth();
+  test_val_limit_global();
+  test_val_sample();
+
+  if (failures)
+  {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("ok\n");
+  return 0;
+}
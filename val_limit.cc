@@ -16,55 +16,19 @@
 #include <mysql.h>
 #include <m_ctype.h>
 #include <m_string.h>
-#include "hash.h"
 #include "val_limit.h"
 
-/* Implementation for the HASH structure */
-typedef struct seen_rec_t {
-  uint count;
-  uint keylen;
-  byte keydata[0]; // key data will get put here
-};
-
-
-static byte *seenhash_get_key(const byte *data,
-                       uint *length,
-                       my_bool not_used __attribute__((unused)))
-{
-  const seen_rec_t *rec = (const seen_rec_t *)data;
-  *length = rec->keylen;
-  return (byte *)rec->keydata;
-}
-
-static void seenhash_free(void *record)
-{
-  my_free((char *)record,MYF(0));
-}
-
-
-
 /* Initialize storage */
 my_bool val_limit_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
 {
   initid->maybe_null = false;
-
-  val_limit_t *data = NULL;
-
-  if (!(data = (val_limit_t *)my_malloc(sizeof(val_limit_t), MYF(MY_FAE))))
-  {
-    strmov(message, "Couldn't allocate memory");
-    goto err;
-  }
-  initid->ptr = (char *)data;
-
-  hash_clear(&data->seen_hash);
-  
+  initid->ptr = NULL;
 
   /* check number of arguments */
   if (args->arg_count != 2)
   {
     strmov(message, "VAL_LIMIT() requires two arguments");
-    goto err;
+    return 1;
   }
 
   /* deal with first parameter (the column) */
@@ -72,7 +36,7 @@ my_bool val_limit_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
       args->args[0] != 0)
   {
     strmov(message, "VAL_LIMIT() requires a non-constant integer as its first argument");
-    goto err;
+    return 1;
   }
 
   /* deal with second parameter (the number of unique vals to permit) */
@@ -80,90 +44,448 @@ my_bool val_limit_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
       args->args[1] == 0)
   {
     strmov(message, "VAL_LIMIT() requires a constant integer as its second argument");
-    goto err;
+    return 1;
+  }
+
+  val_limit_t *data = val_limit_new(*((longlong*) args->args[1]), 1);
+  if (!data)
+  {
+    strmov(message, "Couldn't allocate memory");
+    return 1;
+  }
+  initid->ptr = (char *)data;
+
+  return 0;
+}
+
+longlong val_limit(UDF_INIT *initid, UDF_ARGS *args,
+                   char *is_null,
+                   char *error)
+{
+  val_limit_t *data = (val_limit_t *)initid->ptr;
+
+  if (args->args[0] == NULL)
+    return 1; /* pass through all nulls */
+
+  longlong val= *((longlong*) args->args[0]);
+
+  int res = val_limit_add(data, val);
+  if (res < 0) {
+    *error = 1;
+    return 0;
+  }
+
+  return res;
+}
+
+void val_limit_deinit(UDF_INIT *initid) {
+  val_limit_t *data = (val_limit_t *)initid->ptr;
+
+  if (data != NULL)
+    val_limit_free(data);
+}
+
+/************************************************************/
+
+/**
+ *  VAL_LIMIT_GLOBAL(string namespace, int column, int n [, int ttl [, int capacity]])
+ *     like VAL_LIMIT, but the counts are shared by every connection
+ *     using the same namespace. If ttl is given, counts are kept in
+ *     fixed windows of ttl seconds of wall-clock time and all expire
+ *     together when a window ends, so a count lasts anywhere from 0 to
+ *     ttl seconds. The first statement to use a namespace fixes how many
+ *     distinct values it can hold per window (capacity, default 262144,
+ *     at most 16777216).
+ *
+ *  VAL_LIMIT_GLOBAL_RESET(string namespace)
+ *     expires all the counts in the namespace, returning the number of
+ *     statements currently using it, or -1 if it doesn't exist
+ *
+ *  create function val_limit_global returns integer soname 'libval_limit.so';
+ *  create function val_limit_global_reset returns integer soname 'libval_limit.so';
+ */
+typedef struct val_limit_global
+{
+  val_limit_ns_t *ns;
+  longlong limit;
+} val_limit_global_t;
+
+my_bool val_limit_global_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+  initid->maybe_null = false;
+  initid->ptr = NULL;
+
+  if (args->arg_count < 3 || args->arg_count > 5)
+  {
+    strmov(message, "usage: VAL_LIMIT_GLOBAL(namespace, column, n [, ttl [, capacity]])");
+    return 1;
   }
 
-  data->limit = *((longlong*) args->args[1]);
+  if (args->arg_type[0] != STRING_RESULT ||
+      args->args[0] == 0)
+  {
+    strmov(message, "VAL_LIMIT_GLOBAL() requires a constant string as its first argument");
+    return 1;
+  }
 
-  /* now set up the hash structure based on the type of the column argument */
-  if (hash_init(&data->seen_hash, &my_charset_bin, 32,
-                offsetof(seen_rec_t, keydata), 0, seenhash_get_key,
-                seenhash_free, 0))
+  if (args->arg_type[1] != INT_RESULT ||
+      args->args[1] != 0)
   {
-    strmov(message, "Could not allocate hash");
-    goto err;
+    strmov(message, "VAL_LIMIT_GLOBAL() requires a non-constant integer as its second argument");
+    return 1;
+  }
+
+  for (uint i = 2; i < args->arg_count; i++)
+  {
+    if (args->arg_type[i] != INT_RESULT ||
+        args->args[i] == 0 ||
+        (i > 2 && *((longlong*) args->args[i]) < 0))
+    {
+      strmov(message, "VAL_LIMIT_GLOBAL() requires constant integers for n, ttl and capacity");
+      return 1;
+    }
+  }
+
+  longlong ttl = args->arg_count > 3 ? *((longlong*) args->args[3]) : 0;
+  longlong capacity = args->arg_count > 4 ?
+    *((longlong*) args->args[4]) : VAL_LIMIT_NS_DEFAULT_CAPACITY;
+  if (ttl > VAL_LIMIT_NS_MAX_TTL)
+  {
+    strmov(message, "VAL_LIMIT_GLOBAL() ttl can be at most 315360000 (ten years)");
+    return 1;
+  }
+  if (capacity > VAL_LIMIT_NS_MAX_CAPACITY)
+  {
+    strmov(message, "VAL_LIMIT_GLOBAL() capacity can be at most 16777216");
+    return 1;
+  }
+
+  val_limit_global_t *data =
+    (val_limit_global_t *)malloc(sizeof(val_limit_global_t));
+  if (!data)
+  {
+    strmov(message, "Couldn't allocate memory");
+    return 1;
+  }
+
+  data->limit = *((longlong*) args->args[2]);
+  data->ns = val_limit_ns_acquire(args->args[0], args->lengths[0],
+                                  (unsigned int)ttl, (size_t)capacity, message);
+  if (!data->ns)
+  {
+    free(data);
+    return 1;
   }
 
+  initid->ptr = (char *)data;
   return 0;
+}
+
+longlong val_limit_global(UDF_INIT *initid, UDF_ARGS *args,
+                          char *is_null,
+                          char *error)
+{
+  val_limit_global_t *data = (val_limit_global_t *)initid->ptr;
+
+  if (args->args[1] == NULL)
+    return 1; /* pass through all nulls */
+
+  longlong val= *((longlong*) args->args[1]);
+
+  int res = val_limit_ns_add(data->ns, val, data->limit);
+  if (res < 0) {
+    *error = 1;
+    return 0;
+  }
+
+  return res;
+}
+
+void val_limit_global_deinit(UDF_INIT *initid) {
+  val_limit_global_t *data = (val_limit_global_t *)initid->ptr;
 
-err:
   if (data != NULL)
+  {
+    val_limit_ns_release(data->ns);
     free(data);
-  return 1;
+  }
+}
+
+my_bool val_limit_global_reset_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+  if (args->arg_count != 1 ||
+      args->arg_type[0] != STRING_RESULT)
+  {
+    strmov(message, "usage: VAL_LIMIT_GLOBAL_RESET(namespace)");
+    return 1;
+  }
+
+  initid->maybe_null = 1;
+  return 0;
+}
+
+longlong val_limit_global_reset(UDF_INIT *initid, UDF_ARGS *args,
+                                char *is_null,
+                                char *error)
+{
+  if (args->args[0] == NULL)
+  {
+    *is_null = 1;
+    return 0;
+  }
+
+  return val_limit_ns_reset(args->args[0], args->lengths[0]);
 }
 
-static my_bool add_item(HASH *seen_hash, byte *key, uint keylen, uint *count) {
-  seen_rec_t *found_rec =
-    (seen_rec_t *)hash_search(seen_hash, key, keylen);
+/************************************************************/
+
+/**
+ *  VAL_SAMPLE(int column, real rate [, int seed [, int salt]])
+ *     keeps about rate of the rows, deciding from a seeded hash of the
+ *     value and the salt, so it needs no memory per value. The salt
+ *     should tell apart the rows sharing a value, e.g. a primary key;
+ *     the same seed and salts always keep the same rows.
+ *
+ *     Without a salt each row's position in the whole statement is
+ *     used instead of its position among the rows with its value, as
+ *     that would need a count per value. The sample is then only
+ *     reproducible for the same row order, so pass a salt whenever
+ *     results have to be repeatable.
+ *
+ *  VAL_SAMPLE_LIMIT(int column, real rate, int n [, int distinct [, int seed [, int salt]]])
+ *     as VAL_SAMPLE, but keeps at most n of the sampled rows for each
+ *     value, tracked in a table of counts by hash bucket sized for
+ *     about distinct values (default 1024, at most 4194304; 32 bytes
+ *     or more each). Colliding values share counts, so a few values
+ *     get fewer than n rows: about 3% of them when there are as many
+ *     values as distinct, and about 30% with four times as many (see
+ *     val_limit_core.h).
+ *
+ *  create function val_sample returns integer soname 'libval_limit.so';
+ *  create function val_sample_limit returns integer soname 'libval_limit.so';
+ */
+
+/* shared by VAL_SAMPLE and VAL_SAMPLE_LIMIT; first member of both states */
+typedef struct val_sample_common
+{
+  ulonglong seed;
+  ulonglong ordinal;
+  uint salt_arg;   /* index of the salt argument, 0 if none */
+  my_bool ready;   /* rate is read from the first row */
+} val_sample_common_t;
+
+typedef struct val_sample_udf
+{
+  val_sample_common_t common;
+  val_sample_t sample;
+} val_sample_udf_t;
+
+/* only VAL_SAMPLE_LIMIT pays for the count sketch */
+typedef struct val_sample_limit_udf
+{
+  val_sample_common_t common;
+  val_sample_limit_t state;
+} val_sample_limit_udf_t;
+
+static my_bool val_sample_common_init(UDF_INIT *initid, UDF_ARGS *args,
+                                      char *message, uint min_args,
+                                      uint max_args, const char *usage,
+                                      size_t size)
+{
+  initid->maybe_null = false;
+  initid->ptr = NULL;
+
+  if (args->arg_count < min_args || args->arg_count > max_args)
+  {
+    strmov(message, usage);
+    return 1;
+  }
+
+  if (args->arg_type[0] != INT_RESULT ||
+      args->args[0] != 0)
+  {
+    strmov(message, "VAL_SAMPLE() requires a non-constant integer as its first argument");
+    return 1;
+  }
+
+  if (args->arg_type[1] == STRING_RESULT ||
+      args->args[1] == 0)
+  {
+    strmov(message, "VAL_SAMPLE() requires a constant number as its rate");
+    return 1;
+  }
+  args->arg_type[1] = REAL_RESULT;
 
-  if (found_rec == NULL) {
-    seen_rec_t *rec = (seen_rec_t *)my_malloc(
-      sizeof(seen_rec_t) + keylen, MYF(MY_FAE));
+  val_sample_common_t *common = (val_sample_common_t *)malloc(size);
+  if (!common)
+  {
+    strmov(message, "Couldn't allocate memory");
+    return 1;
+  }
+  common->seed = 0;
+  common->ordinal = 0;
+  common->salt_arg = 0;
+  common->ready = false;
 
-    rec->count = 1;
-    rec->keylen = keylen;
-    memcpy(rec->keydata, key, keylen);
+  initid->ptr = (char *)common;
+  return 0;
+}
 
-    if (my_hash_insert(seen_hash, (byte *)rec))
+/* reads the optional seed and salt at positions seed_arg and seed_arg + 1 */
+static my_bool val_sample_seed_salt(UDF_ARGS *args, uint seed_arg,
+                                    val_sample_common_t *common, char *message)
+{
+  if (args->arg_count > seed_arg)
+  {
+    if (args->arg_type[seed_arg] != INT_RESULT ||
+        args->args[seed_arg] == 0)
     {
+      strmov(message, "VAL_SAMPLE() requires a constant integer seed");
       return 1;
     }
-    *count = 1;
-  } else {
-    *count = ++found_rec->count;
+    common->seed = *((longlong*) args->args[seed_arg]);
   }
 
+  if (args->arg_count > seed_arg + 1)
+  {
+    if (args->arg_type[seed_arg + 1] != INT_RESULT)
+    {
+      strmov(message, "VAL_SAMPLE() requires an integer salt");
+      return 1;
+    }
+    common->salt_arg = seed_arg + 1;
+  }
   return 0;
 }
 
-static my_bool add_int_item(HASH *seen_hash, longlong val, uint *count) {
-  byte *searchkey = (byte *)&val;
-
-  return add_item(seen_hash, searchkey, sizeof(longlong), count);
+static ulonglong val_sample_salt(val_sample_common_t *common, UDF_ARGS *args)
+{
+  ulonglong ordinal = common->ordinal++;
+  if (!common->salt_arg)
+    return ordinal;
+  return args->args[common->salt_arg] ? *((longlong*) args->args[common->salt_arg]) : 0;
 }
 
+my_bool val_sample_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+  if (val_sample_common_init(initid, args, message, 2, 4,
+                             "usage: VAL_SAMPLE(column, rate [, seed [, salt]])",
+                             sizeof(val_sample_udf_t)))
+    return 1;
 
-longlong val_limit(UDF_INIT *initid, UDF_ARGS *args,
-                   char *is_null,
-                   char *error)
+  val_sample_udf_t *data = (val_sample_udf_t *)initid->ptr;
+  if (val_sample_seed_salt(args, 2, &data->common, message))
+  {
+    free(data);
+    initid->ptr = NULL;
+    return 1;
+  }
+
+  return 0;
+}
+
+longlong val_sample(UDF_INIT *initid, UDF_ARGS *args,
+                    char *is_null,
+                    char *error)
 {
-  val_limit_t *data = (val_limit_t *)initid->ptr;
+  val_sample_udf_t *data = (val_sample_udf_t *)initid->ptr;
 
-  if (*is_null)
+  if (!data->common.ready)
+  {
+    val_sample_setup(&data->sample, *((double*) args->args[1]), data->common.seed);
+    data->common.ready = true;
+  }
+
+  ulonglong salt = val_sample_salt(&data->common, args);
+
+  if (args->args[0] == NULL)
     return 1; /* pass through all nulls */
 
   longlong val= *((longlong*) args->args[0]);
+  return val_sample_keep(&data->sample, val, salt);
+}
 
-  uint count = 0;
-  my_bool err = add_int_item(&data->seen_hash, val, &count);
-  if (err) {
-    *error = 1;
-    return 0;
-  }
+void val_sample_deinit(UDF_INIT *initid)
+{
+  if (initid->ptr != NULL)
+    free(initid->ptr);
+}
 
-  if (count <= data->limit)
+my_bool val_sample_limit_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+  if (val_sample_common_init(initid, args, message, 3, 6,
+                             "usage: VAL_SAMPLE_LIMIT(column, rate, n [, distinct [, seed [, salt]]])",
+                             sizeof(val_sample_limit_udf_t)))
     return 1;
-  else
-    return 0;
+
+  val_sample_limit_udf_t *data = (val_sample_limit_udf_t *)initid->ptr;
+  longlong distinct = VAL_SAMPLE_DEFAULT_DISTINCT;
+  data->state.counts = NULL;
+
+  for (uint i = 2; i < 4 && i < args->arg_count; i++)
+  {
+    if (args->arg_type[i] != INT_RESULT ||
+        args->args[i] == 0)
+    {
+      strmov(message, "VAL_SAMPLE_LIMIT() requires constant integers for n and distinct");
+      goto err;
+    }
+  }
+  data->state.limit = *((longlong*) args->args[2]);
+  if (args->arg_count > 3)
+    distinct = *((longlong*) args->args[3]);
+  if (distinct <= 0 || distinct > VAL_SAMPLE_MAX_DISTINCT)
+  {
+    strmov(message, "VAL_SAMPLE_LIMIT() distinct must be between 1 and 4194304");
+    goto err;
+  }
+
+  if (val_sample_seed_salt(args, 4, &data->common, message))
+    goto err;
+
+  if (!val_sample_limit_init(&data->state, (size_t)distinct))
+  {
+    strmov(message, "Couldn't allocate memory");
+    goto err;
+  }
+
+  return 0;
+
+err:
+  free(data);
+  initid->ptr = NULL;
+  return 1;
 }
 
-void val_limit_deinit(UDF_INIT *initid) {
-  val_limit_t *data = (val_limit_t *)initid->ptr;
+longlong val_sample_limit(UDF_INIT *initid, UDF_ARGS *args,
+                          char *is_null,
+                          char *error)
+{
+  val_sample_limit_udf_t *data = (val_sample_limit_udf_t *)initid->ptr;
+
+  if (!data->common.ready)
+  {
+    val_sample_limit_setup(&data->state, *((double*) args->args[1]),
+                           data->state.limit, data->common.seed);
+    data->common.ready = true;
+  }
+
+  ulonglong salt = val_sample_salt(&data->common, args);
+
+  if (args->args[0] == NULL)
+    return 1; /* pass through all nulls */
+
+  longlong val= *((longlong*) args->args[0]);
+  return val_sample_limit_keep(&data->state, val, salt);
+}
+
+void val_sample_limit_deinit(UDF_INIT *initid)
+{
+  val_sample_limit_udf_t *data = (val_sample_limit_udf_t *)initid->ptr;
 
   if (data != NULL)
   {
-    if (hash_inited(&data->seen_hash))
-      hash_free(&data->seen_hash);
+    val_sample_limit_free(&data->state);
     free(data);
   }
 }
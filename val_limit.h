@@ -1,7 +1,8 @@
 #ifndef VAL_LIMIT_H
 #define VAL_LIMIT_H
 
-#include "hash.h"
+#include "val_limit_core.h"
+#include "val_limit_global.h"
 
 extern "C" {
   my_bool val_limit_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
@@ -10,12 +11,29 @@ extern "C" {
                      char *is_null,
                      char *error);
   void val_limit_deinit(UDF_INIT *initid);
-}
 
-typedef struct val_limit
-{
-  HASH seen_hash;
-  longlong limit;
-} val_limit_t;
+  my_bool val_limit_global_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+  longlong val_limit_global(UDF_INIT *initid, UDF_ARGS *args,
+                            char *is_null,
+                            char *error);
+  void val_limit_global_deinit(UDF_INIT *initid);
+
+  my_bool val_limit_global_reset_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+  longlong val_limit_global_reset(UDF_INIT *initid, UDF_ARGS *args,
+                                  char *is_null,
+                                  char *error);
+
+  my_bool val_sample_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+  longlong val_sample(UDF_INIT *initid, UDF_ARGS *args,
+                      char *is_null,
+                      char *error);
+  void val_sample_deinit(UDF_INIT *initid);
+
+  my_bool val_sample_limit_init(UDF_INIT *initid, UDF_ARGS *args, char *message);
+  longlong val_sample_limit(UDF_INIT *initid, UDF_ARGS *args,
+                            char *is_null,
+                            char *error);
+  void val_sample_limit_deinit(UDF_INIT *initid);
+}
 
 #endif
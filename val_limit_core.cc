@@ -0,0 +1,338 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "val_limit_core.h"
+
+#define VAL_LIMIT_INITIAL_CAPACITY 32
+
+/* the partition uses the high bits of the hash, the slot the low bits */
+static inline unsigned int val_limit_part(const val_limit_t *vl,
+                                          unsigned long long hash)
+{
+  return (unsigned int)((hash >> 32) % vl->nparts);
+}
+
+static bool table_alloc(val_limit_table_t *t, size_t capacity)
+{
+  t->keys = (long long *)malloc(capacity * sizeof(long long));
+  t->counts = (unsigned int *)calloc(capacity, sizeof(unsigned int));
+  if (!t->keys || !t->counts)
+  {
+    free(t->keys);
+    free(t->counts);
+    t->keys = NULL;
+    t->counts = NULL;
+    return false;
+  }
+  t->capacity = capacity;
+  t->size = 0;
+  return true;
+}
+
+/* returns the slot holding val, or the free slot where it belongs */
+static size_t table_find(const val_limit_table_t *t, long long val,
+                         unsigned long long hash)
+{
+  size_t mask = t->capacity - 1;
+  size_t slot = hash & mask;
+  while (t->counts[slot] && t->keys[slot] != val)
+    slot = (slot + 1) & mask;
+  return slot;
+}
+
+static bool table_grow(val_limit_table_t *t)
+{
+  val_limit_table_t old = *t;
+  if (!table_alloc(t, old.capacity * 2))
+  {
+    *t = old;
+    return false;
+  }
+
+  for (size_t i = 0; i < old.capacity; i++)
+  {
+    if (!old.counts[i])
+      continue;
+    size_t slot = table_find(t, old.keys[i], val_limit_hash(old.keys[i]));
+    t->keys[slot] = old.keys[i];
+    t->counts[slot] = old.counts[i];
+    t->size++;
+  }
+
+  free(old.keys);
+  free(old.counts);
+  return true;
+}
+
+static int table_add(val_limit_table_t *t, long long limit, long long val,
+                     unsigned long long hash)
+{
+  size_t slot = table_find(t, val, hash);
+
+  if (!t->counts[slot])
+  {
+    /* keep the load factor at or below one half */
+    if ((t->size + 1) * 2 > t->capacity)
+    {
+      if (!table_grow(t))
+        return -1;
+      slot = table_find(t, val, hash);
+    }
+    t->keys[slot] = val;
+    t->counts[slot] = 1;
+    t->size++;
+  }
+  else if (t->counts[slot] <= limit && t->counts[slot] != UINT_MAX)
+  {
+    /* stop counting once past the limit so the counter can't wrap */
+    t->counts[slot]++;
+  }
+
+  return t->counts[slot] <= limit;
+}
+
+val_limit_t *val_limit_new(long long limit, unsigned int nparts)
+{
+  if (nparts == 0)
+    nparts = 1;
+
+  val_limit_t *vl = (val_limit_t *)malloc(sizeof(val_limit_t));
+  if (!vl)
+    return NULL;
+
+  vl->limit = limit;
+  vl->nparts = nparts;
+  vl->parts = (val_limit_table_t *)calloc(nparts, sizeof(val_limit_table_t));
+  if (!vl->parts)
+  {
+    free(vl);
+    return NULL;
+  }
+
+  for (unsigned int i = 0; i < nparts; i++)
+  {
+    if (!table_alloc(&vl->parts[i], VAL_LIMIT_INITIAL_CAPACITY))
+    {
+      val_limit_free(vl);
+      return NULL;
+    }
+  }
+
+  return vl;
+}
+
+void val_limit_free(val_limit_t *vl)
+{
+  for (unsigned int i = 0; i < vl->nparts; i++)
+  {
+    free(vl->parts[i].keys);
+    free(vl->parts[i].counts);
+  }
+  free(vl->parts);
+  free(vl);
+}
+
+int val_limit_add(val_limit_t *vl, long long val)
+{
+  unsigned long long hash = val_limit_hash(val);
+  return table_add(&vl->parts[val_limit_part(vl, hash)], vl->limit, val, hash);
+}
+
+bool val_limit_batch(val_limit_t *vl, const long long *vals,
+                     const char *nulls, size_t n, char *out)
+{
+  for (size_t i = 0; i < n; i++)
+  {
+    if (nulls && nulls[i])
+    {
+      out[i] = 1;
+      continue;
+    }
+
+    int res = val_limit_add(vl, vals[i]);
+    if (res < 0)
+      return false;
+    out[i] = res;
+  }
+  return true;
+}
+
+typedef struct val_limit_batch_ctx
+{
+  val_limit_t *vl;
+  const long long *vals;
+  const unsigned long long *hashes;
+  const size_t *rows;    /* non-null row numbers, grouped by partition */
+  const size_t *starts;  /* partition p's rows are rows[starts[p]..starts[p + 1]) */
+  char *out;
+  bool failed;           /* set with __atomic_store_n by any worker */
+} val_limit_batch_ctx_t;
+
+/*
+ * Handles the rows belonging to partitions [begin, end). Partitions own
+ * disjoint rows, so the calls never write to the same table or output
+ * byte.
+ */
+static void val_limit_batch_parts(void *arg, size_t begin, size_t end)
+{
+  val_limit_batch_ctx_t *ctx = (val_limit_batch_ctx_t *)arg;
+  val_limit_t *vl = ctx->vl;
+
+  for (size_t part = begin; part < end; part++)
+  {
+    for (size_t j = ctx->starts[part]; j < ctx->starts[part + 1]; j++)
+    {
+      size_t i = ctx->rows[j];
+      int res = table_add(&vl->parts[part], vl->limit, ctx->vals[i], ctx->hashes[i]);
+      if (res < 0)
+      {
+        __atomic_store_n(&ctx->failed, true, __ATOMIC_RELAXED);
+        return;
+      }
+      ctx->out[i] = res;
+    }
+  }
+}
+
+bool val_limit_batch_parallel(work_pool_t *pool, val_limit_t *vl,
+                              const long long *vals, const char *nulls,
+                              size_t n, char *out)
+{
+  if (vl->nparts == 1)
+    return val_limit_batch(vl, vals, nulls, n, out);
+
+  unsigned long long *hashes = (unsigned long long *)malloc(n * sizeof(*hashes));
+  size_t *rows = (size_t *)malloc(n * sizeof(*rows));
+  size_t *starts = (size_t *)calloc(vl->nparts + 1, sizeof(*starts));
+  bool ok = false;
+  if (!hashes || !rows || !starts)
+    goto err;
+
+  /*
+   * Scatter the rows by partition once, keeping each partition's rows
+   * in order, so every worker only visits its own rows.
+   */
+  for (size_t i = 0; i < n; i++)
+  {
+    if (nulls && nulls[i])
+    {
+      out[i] = 1;
+      continue;
+    }
+    hashes[i] = val_limit_hash(vals[i]);
+    starts[val_limit_part(vl, hashes[i]) + 1]++;
+  }
+  for (unsigned int p = 0; p < vl->nparts; p++)
+    starts[p + 1] += starts[p];
+  {
+    /* starts[p] serves as partition p's fill position, then is restored */
+    for (size_t i = 0; i < n; i++)
+    {
+      if (!(nulls && nulls[i]))
+        rows[starts[val_limit_part(vl, hashes[i])]++] = i;
+    }
+    for (unsigned int p = vl->nparts; p > 0; p--)
+      starts[p] = starts[p - 1];
+    starts[0] = 0;
+  }
+
+  {
+    val_limit_batch_ctx_t ctx = { vl, vals, hashes, rows, starts, out, false };
+    work_pool_run(pool, vl->nparts, 1, val_limit_batch_parts, &ctx);
+    ok = !ctx.failed;
+  }
+
+err:
+  free(starts);
+  free(rows);
+  free(hashes);
+  return ok;
+}
+
+/************************************************************/
+
+static inline unsigned long long mix64(unsigned long long h)
+{
+  /* splitmix64 finalizer */
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+  return h;
+}
+
+unsigned long long val_sample_hash(long long val, unsigned long long salt,
+                                   unsigned long long seed)
+{
+  unsigned long long h = mix64((unsigned long long)val + seed * 0x9e3779b97f4a7c15ULL);
+  return mix64(h ^ (salt + 0x9e3779b97f4a7c15ULL));
+}
+
+void val_sample_setup(val_sample_t *vs, double rate, unsigned long long seed)
+{
+  vs->seed = seed;
+  vs->keep_all = rate >= 1.0;
+  if (vs->keep_all || rate <= 0.0)
+    vs->threshold = 0;
+  else
+    vs->threshold = (unsigned long long)(rate * 18446744073709551616.0);
+}
+
+bool val_sample_keep(const val_sample_t *vs, long long val,
+                     unsigned long long salt)
+{
+  return vs->keep_all ||
+         val_sample_hash(val, salt, vs->seed) < vs->threshold;
+}
+
+bool val_sample_limit_init(val_sample_limit_t *vsl, size_t distinct)
+{
+  if (distinct > VAL_SAMPLE_MAX_DISTINCT)
+    distinct = VAL_SAMPLE_MAX_DISTINCT;
+
+  vsl->buckets = 64;
+  while (vsl->buckets < distinct * 4)
+    vsl->buckets *= 2;
+
+  vsl->counts = (unsigned int *)calloc(2 * vsl->buckets, sizeof(unsigned int));
+  return vsl->counts != NULL;
+}
+
+void val_sample_limit_free(val_sample_limit_t *vsl)
+{
+  free(vsl->counts);
+  vsl->counts = NULL;
+}
+
+void val_sample_limit_setup(val_sample_limit_t *vsl, double rate,
+                            long long limit, unsigned long long seed)
+{
+  val_sample_setup(&vsl->sample, rate, seed);
+  vsl->limit = limit;
+  memset(vsl->counts, 0, 2 * vsl->buckets * sizeof(unsigned int));
+}
+
+bool val_sample_limit_keep(val_sample_limit_t *vsl, long long val,
+                           unsigned long long salt)
+{
+  if (!val_sample_keep(&vsl->sample, val, salt))
+    return false;
+
+  /* two bucket indexes from one hash of the value alone */
+  unsigned long long h = val_sample_hash(val, 0, ~vsl->sample.seed);
+  size_t mask = vsl->buckets - 1;
+  unsigned int *a = &vsl->counts[h & mask];
+  unsigned int *b = &vsl->counts[vsl->buckets + ((h >> 32) & mask)];
+
+  /* the smaller counter is the tighter upper bound on this value's count */
+  unsigned int seen = (*a < *b) ? *a : *b;
+  if (seen >= vsl->limit)
+    return false;
+
+  if (*a == seen)
+    (*a)++;
+  if (*b == seen)
+    (*b)++;
+  return true;
+}
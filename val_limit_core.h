@@ -0,0 +1,139 @@
+#ifndef VAL_LIMIT_CORE_H
+#define VAL_LIMIT_CORE_H
+
+/**
+ * Value-limit logic behind VAL_LIMIT, usable outside of MySQL.
+ *
+ * A val_limit_t counts how often each value has been seen and accepts
+ * a value only while its count is within the limit. The counters are
+ * split into partitions by hash of the value; rows with different
+ * values never touch the same partition, which lets
+ * val_limit_batch_parallel() work on the partitions concurrently while
+ * still seeing each value's rows in order.
+ *
+ * A single val_limit_t is not thread-safe otherwise.
+ */
+
+#include <stddef.h>
+#include "work_pool.h"
+
+/* hash used to place values, shared with the VAL_LIMIT_GLOBAL tables */
+static inline unsigned long long val_limit_hash(long long val)
+{
+  /* murmur3 finalizer */
+  unsigned long long h = (unsigned long long)val;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb3fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/* open-addressed table of value -> count; a zero count marks a free slot */
+typedef struct val_limit_table
+{
+  long long *keys;
+  unsigned int *counts;
+  size_t capacity;   /* always a power of two */
+  size_t size;
+} val_limit_table_t;
+
+typedef struct val_limit
+{
+  long long limit;
+  unsigned int nparts;
+  val_limit_table_t *parts;
+} val_limit_t;
+
+val_limit_t *val_limit_new(long long limit, unsigned int nparts);
+void val_limit_free(val_limit_t *vl);
+
+/*
+ * Counts one more occurrence of val. Returns 1 if it is still within
+ * the limit, 0 if not, and -1 if memory ran out.
+ */
+int val_limit_add(val_limit_t *vl, long long val);
+
+/*
+ * Runs val_limit_add over n values, setting out[i] to 1 or 0. Rows
+ * with nulls[i] set (if nulls is given) always pass. Returns false if
+ * memory ran out.
+ */
+bool val_limit_batch(val_limit_t *vl, const long long *vals,
+                     const char *nulls, size_t n, char *out);
+
+/*
+ * Same as val_limit_batch, with the partitions spread over pool. The
+ * rows are first grouped by partition, which takes about 16 bytes of
+ * scratch memory per row.
+ */
+bool val_limit_batch_parallel(work_pool_t *pool, val_limit_t *vl,
+                              const long long *vals, const char *nulls,
+                              size_t n, char *out);
+
+/************************************************************/
+
+/*
+ * Hash-based sampling (VAL_SAMPLE).
+ *
+ * A row is kept if a seeded hash of its value and a salt falls below
+ * rate * 2^64, so no state is needed per value and the same seed
+ * always picks the same rows. The salt should tell apart the rows
+ * sharing a value, such as a primary key or the row's position among
+ * them; a position in the whole input also works, but then the same
+ * seed only picks the same rows for the same input order.
+ *
+ * val_sample_limit_t additionally caps the rows kept per value at
+ * about limit. It keeps a fixed count-min sketch of counts per hash
+ * bucket rather than a count per value: colliding values share
+ * counters, so a value may be cut off early but never gets more than
+ * limit rows.
+ */
+
+/* expected distinct values the count sketch is sized for */
+#define VAL_SAMPLE_DEFAULT_DISTINCT 1024
+#define VAL_SAMPLE_MAX_DISTINCT (1 << 22)
+
+typedef struct val_sample
+{
+  unsigned long long seed;
+  unsigned long long threshold;
+  bool keep_all;
+} val_sample_t;
+
+typedef struct val_sample_limit
+{
+  val_sample_t sample;
+  long long limit;
+  size_t buckets;        /* per row of the sketch, a power of two */
+  unsigned int *counts;  /* two rows of buckets counters */
+} val_sample_limit_t;
+
+unsigned long long val_sample_hash(long long val, unsigned long long salt,
+                                   unsigned long long seed);
+
+/* rate is the fraction of rows to keep, from 0 to 1 */
+void val_sample_setup(val_sample_t *vs, double rate, unsigned long long seed);
+bool val_sample_keep(const val_sample_t *vs, long long val,
+                     unsigned long long salt);
+
+/*
+ * Allocates a sketch for about distinct values: two rows of the next
+ * power of two of at least 4 * distinct counters, 32 bytes or more per
+ * value. Measured with limit 3 and every value offering 5 rows, about
+ * 3% of the values end up with fewer than limit rows and under 0.5%
+ * with none. With twice as many values as planned for that is about
+ * 10% and 0.5%, and with four times as many about 30% and 2%.
+ * Returns false if memory ran out.
+ */
+bool val_sample_limit_init(val_sample_limit_t *vsl, size_t distinct);
+void val_sample_limit_free(val_sample_limit_t *vsl);
+
+/* resets the counts, so the sketch can be reused */
+void val_sample_limit_setup(val_sample_limit_t *vsl, double rate,
+                            long long limit, unsigned long long seed);
+bool val_sample_limit_keep(val_sample_limit_t *vsl, long long val,
+                           unsigned long long salt);
+
+#endif
@@ -0,0 +1,316 @@
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "val_limit_core.h"
+#include "val_limit_global.h"
+
+#define NS_SHARD_BITS 6
+#define NS_SHARDS (1 << NS_SHARD_BITS)
+#define NS_MIN_SHARD_CAPACITY 16
+
+/*
+ * A slot is a key and a control word packing the rest of its state:
+ *
+ *   bit 63       slot is in use
+ *   bits 32-62   generation the count belongs to
+ *   bits 0-31    count
+ *
+ * An empty slot is all zeros. Both words are always updated together
+ * with a double-width CAS, so a slot is never seen with a new key and
+ * an old count or the other way round, and nobody ever waits on a
+ * half-written slot.
+ *
+ * A slot from an older generation holds no live count, so it may be
+ * claimed again for any value. Within one generation slots only ever
+ * become current, never stale, so a value counted in the current
+ * generation always sits before the first empty or stale slot of its
+ * probe sequence; the probe can stop there.
+ */
+#define CTL_USED (1ULL << 63)
+#define CTL_GEN_MASK 0x7fffffffULL
+#define CTL_GEN_HALF 0x40000000U
+
+#define ctl_make(gen, count) (CTL_USED | ((unsigned long long)(gen) << 32) | (count))
+#define ctl_gen(ctl) (((ctl) >> 32) & CTL_GEN_MASK)
+#define ctl_count(ctl) ((unsigned int)(ctl))
+
+typedef unsigned __int128 ns_pair_t;
+
+typedef union ns_slot
+{
+  struct
+  {
+    long long key;
+    unsigned long long ctl;
+  } s;
+  ns_pair_t pair;
+} __attribute__((aligned(16))) ns_slot_t;
+
+struct val_limit_ns
+{
+  char *name;
+  size_t name_len;
+  unsigned int ttl;
+  size_t shard_capacity;   /* slots per shard, a power of two */
+
+  unsigned int refs;       /* protected by ns_lock */
+  unsigned int reset_gen;  /* bumped by val_limit_ns_reset() */
+  ns_slot_t *shards[NS_SHARDS];  /* allocated on first use */
+
+  struct val_limit_ns *next;
+};
+
+/* only taken when namespaces are looked up, never when counting */
+static pthread_mutex_t ns_lock = PTHREAD_MUTEX_INITIALIZER;
+static val_limit_ns_t *ns_list = NULL;
+
+/*
+ * Reads a consistent key and control word. On x86-64 the two words are
+ * read separately (a 16 byte atomic load would need a locked write):
+ * every update that changes the key also moves the control word to a
+ * newer generation, and it never goes back, so seeing the same control
+ * word before and after reading the key means the key belongs to it.
+ */
+static inline void slot_load(ns_slot_t *slot, long long *key,
+                             unsigned long long *ctl)
+{
+#ifdef __x86_64__
+  unsigned long long before = __atomic_load_n(&slot->s.ctl, __ATOMIC_ACQUIRE);
+  for (;;)
+  {
+    *key = __atomic_load_n(&slot->s.key, __ATOMIC_ACQUIRE);
+    *ctl = __atomic_load_n(&slot->s.ctl, __ATOMIC_ACQUIRE);
+    if (*ctl == before)
+      return;
+    before = *ctl;  /* somebody updated the slot; try again */
+  }
+#else
+  ns_slot_t v;
+  v.pair = __atomic_load_n(&slot->pair, __ATOMIC_ACQUIRE);
+  *key = v.s.key;
+  *ctl = v.s.ctl;
+#endif
+}
+
+/*
+ * Replaces the slot's key and control word if they still hold the
+ * given ones. Other platforms get whatever their 16 byte
+ * __atomic_compare_exchange is, which may need -latomic and is only
+ * lock-free where the hardware has a double-width CAS.
+ */
+#ifdef __x86_64__
+__attribute__((target("cx16")))
+#endif
+static inline bool slot_cas(ns_slot_t *slot, long long key, unsigned long long ctl,
+                            long long new_key, unsigned long long new_ctl)
+{
+  ns_slot_t expected, desired;
+  expected.s.key = key;
+  expected.s.ctl = ctl;
+  desired.s.key = new_key;
+  desired.s.ctl = new_ctl;
+#ifdef __x86_64__
+  return __sync_bool_compare_and_swap(&slot->pair, expected.pair, desired.pair);
+#else
+  return __atomic_compare_exchange_n(&slot->pair, &expected.pair, desired.pair,
+                                     false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#endif
+}
+
+static unsigned int ns_generation(val_limit_ns_t *ns)
+{
+  unsigned long long gen = __atomic_load_n(&ns->reset_gen, __ATOMIC_ACQUIRE);
+  if (ns->ttl)
+    gen += (unsigned long long)time(NULL) / ns->ttl;
+  return (unsigned int)(gen & CTL_GEN_MASK);
+}
+
+/*
+ * true if generation a comes before b. Generations wrap around, and
+ * threads may disagree by one around a window boundary, so compare
+ * them as a distance rather than by value.
+ */
+static inline bool ns_gen_older(unsigned int a, unsigned int b)
+{
+  unsigned int d = (b - a) & CTL_GEN_MASK;
+  return d != 0 && d < CTL_GEN_HALF;
+}
+
+static ns_slot_t *ns_shard(val_limit_ns_t *ns, unsigned int i)
+{
+  ns_slot_t *slots = __atomic_load_n(&ns->shards[i], __ATOMIC_ACQUIRE);
+  if (slots)
+    return slots;
+
+  /* the double-width CAS needs 16 byte aligned slots */
+  ns_slot_t *fresh;
+  if (posix_memalign((void **)&fresh, sizeof(ns_slot_t),
+                     ns->shard_capacity * sizeof(ns_slot_t)))
+    return NULL;
+  memset(fresh, 0, ns->shard_capacity * sizeof(ns_slot_t));
+
+  if (!__atomic_compare_exchange_n(&ns->shards[i], &slots, fresh, false,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+  {
+    /* somebody else got there first */
+    free(fresh);
+    return slots;
+  }
+  return fresh;
+}
+
+static val_limit_ns_t *ns_find(const char *name, size_t len)
+{
+  for (val_limit_ns_t *ns = ns_list; ns; ns = ns->next)
+  {
+    if (ns->name_len == len && memcmp(ns->name, name, len) == 0)
+      return ns;
+  }
+  return NULL;
+}
+
+static void ns_free_shards(val_limit_ns_t *ns)
+{
+  for (unsigned int i = 0; i < NS_SHARDS; i++)
+  {
+    free(ns->shards[i]);
+    ns->shards[i] = NULL;
+  }
+}
+
+val_limit_ns_t *val_limit_ns_acquire(const char *name, size_t len,
+                                     unsigned int ttl, size_t capacity,
+                                     char *message)
+{
+  if (ttl > VAL_LIMIT_NS_MAX_TTL || capacity > VAL_LIMIT_NS_MAX_CAPACITY)
+  {
+    strcpy(message, "VAL_LIMIT_GLOBAL ttl or capacity is too large");
+    return NULL;
+  }
+
+  pthread_mutex_lock(&ns_lock);
+
+  val_limit_ns_t *ns = ns_find(name, len);
+  if (ns)
+  {
+    if (ns->ttl != ttl)
+    {
+      strcpy(message, "VAL_LIMIT_GLOBAL namespace already exists with a different ttl");
+      ns = NULL;
+    }
+    else
+    {
+      ns->refs++;
+    }
+    pthread_mutex_unlock(&ns_lock);
+    return ns;
+  }
+
+  ns = (val_limit_ns_t *)calloc(1, sizeof(val_limit_ns_t));
+  if (!ns || !(ns->name = (char *)malloc(len ? len : 1)))
+  {
+    free(ns);
+    strcpy(message, "Couldn't allocate memory");
+    pthread_mutex_unlock(&ns_lock);
+    return NULL;
+  }
+
+  memcpy(ns->name, name, len);
+  ns->name_len = len;
+  ns->ttl = ttl;
+  /* leave headroom for values not spreading evenly over the shards */
+  size_t per_shard = (capacity * 2 + NS_SHARDS - 1) / NS_SHARDS;
+  ns->shard_capacity = NS_MIN_SHARD_CAPACITY;
+  while (ns->shard_capacity < per_shard)
+    ns->shard_capacity *= 2;
+  ns->refs = 1;
+
+  ns->next = ns_list;
+  ns_list = ns;
+
+  pthread_mutex_unlock(&ns_lock);
+  return ns;
+}
+
+void val_limit_ns_release(val_limit_ns_t *ns)
+{
+  pthread_mutex_lock(&ns_lock);
+  ns->refs--;
+  pthread_mutex_unlock(&ns_lock);
+}
+
+int val_limit_ns_add(val_limit_ns_t *ns, long long val, long long limit)
+{
+  unsigned long long hash = val_limit_hash(val);
+  unsigned int gen = ns_generation(ns);
+
+  ns_slot_t *slots = ns_shard(ns, (unsigned int)(hash >> (64 - NS_SHARD_BITS)));
+  if (!slots)
+    return -1;
+
+  size_t mask = ns->shard_capacity - 1;
+  size_t i = hash & mask;
+  for (size_t probe = 0; probe < ns->shard_capacity; probe++, i = (i + 1) & mask)
+  {
+    ns_slot_t *slot = &slots[i];
+    long long key;
+    unsigned long long ctl;
+
+    for (;;)
+    {
+      slot_load(slot, &key, &ctl);
+
+      if (ctl == 0 || ns_gen_older(ctl_gen(ctl), gen))
+      {
+        /*
+         * Empty, or only holding an expired count: val isn't counted in
+         * this generation, so take the slot over with the first count.
+         */
+        if (slot_cas(slot, key, ctl, val, ctl_make(gen, 1)))
+          return 1 <= limit;
+        continue;  /* somebody else changed the slot; look again */
+      }
+
+      if (key != val)
+        break;
+
+      /*
+       * A slot from a newer generation means another thread is already
+       * past a window boundary we haven't seen yet; count in its
+       * generation rather than moving the slot back.
+       */
+      unsigned int count = ctl_count(ctl);
+      if (count > limit)
+        return 0;  /* already past the limit, stop counting */
+      if (count == UINT_MAX)
+        return 1;
+
+      if (slot_cas(slot, key, ctl, key, ctl_make(ctl_gen(ctl), count + 1)))
+        return count + 1 <= limit;
+    }
+  }
+
+  return -1;  /* every slot holds a live count */
+}
+
+long long val_limit_ns_reset(const char *name, size_t len)
+{
+  long long refs = -1;
+
+  pthread_mutex_lock(&ns_lock);
+  val_limit_ns_t *ns = ns_find(name, len);
+  if (ns)
+  {
+    __atomic_add_fetch(&ns->reset_gen, 1, __ATOMIC_RELEASE);
+
+    /* nobody can be counting, so the slots can go too */
+    if (ns->refs == 0)
+      ns_free_shards(ns);
+    refs = ns->refs;
+  }
+  pthread_mutex_unlock(&ns_lock);
+
+  return refs;
+}
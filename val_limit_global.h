@@ -0,0 +1,67 @@
+#ifndef VAL_LIMIT_GLOBAL_H
+#define VAL_LIMIT_GLOBAL_H
+
+/**
+ * Process-wide value counters behind VAL_LIMIT_GLOBAL.
+ *
+ * Counters live in named namespaces shared by every thread in the
+ * process. Looking a namespace up takes a mutex, so callers resolve it
+ * once (VAL_LIMIT_GLOBAL does it in init) and hold on to it;
+ * counting values in it takes no lock and never waits on another
+ * thread. It is lock-free on x86-64, where each slot is updated with a
+ * 16 byte compare-and-swap (cmpxchg16b), and on other platforms as long
+ * as their 16 byte atomics are.
+ *
+ * Each namespace is a fixed-capacity open-addressed table split into
+ * shards by hash.
+ * A count only holds for the generation of the namespace it was made
+ * in, and once the generation moves on its slot may be claimed by any
+ * value, so capacity limits the distinct values per generation rather
+ * than over the namespace's lifetime. A reset while nobody holds the
+ * namespace also frees its slots.
+ *
+ * The generation moves on at val_limit_ns_reset() and, if the
+ * namespace has a ttl, at every multiple of ttl seconds of wall-clock
+ * time. Windows are fixed rather than sliding: a count expires at the
+ * end of the window it was made in, anywhere from 0 to ttl seconds
+ * later, and every count in the namespace expires at once. A count made
+ * by a thread that hasn't yet seen a window boundary may be lost.
+ */
+
+#include <stddef.h>
+
+typedef struct val_limit_ns val_limit_ns_t;
+
+#define VAL_LIMIT_NS_DEFAULT_CAPACITY (1 << 18)
+#define VAL_LIMIT_NS_MAX_CAPACITY (1 << 24)  /* about 512MB of slots */
+#define VAL_LIMIT_NS_MAX_TTL (3650 * 86400)  /* ten years */
+
+/*
+ * Returns the namespace called name, creating it if needed, and takes
+ * a reference to it. ttl is in seconds, 0 meaning counts never expire
+ * by age. capacity is the number of distinct values the namespace
+ * should hold, and is only used when it is created. Returns
+ * NULL and fills in message (at least 80 bytes) on failure, including
+ * when the namespace already exists with a different ttl, or ttl or
+ * capacity are above VAL_LIMIT_NS_MAX_TTL or VAL_LIMIT_NS_MAX_CAPACITY.
+ */
+val_limit_ns_t *val_limit_ns_acquire(const char *name, size_t len,
+                                     unsigned int ttl, size_t capacity,
+                                     char *message);
+void val_limit_ns_release(val_limit_ns_t *ns);
+
+/*
+ * Counts one more occurrence of val. Returns 1 if it is still within
+ * limit, 0 if not, and -1 if the namespace already holds as many
+ * values in this generation as it can, or is out of memory.
+ */
+int val_limit_ns_add(val_limit_ns_t *ns, long long val, long long limit);
+
+/*
+ * Expires every count in the namespace. Returns the number of
+ * references held on it at the time, or -1 if there is no such
+ * namespace.
+ */
+long long val_limit_ns_reset(const char *name, size_t len);
+
+#endif
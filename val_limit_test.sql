@@ -0,0 +1,47 @@
+drop function val_limit;
+drop function val_limit_global;
+drop function val_limit_global_reset;
+drop function val_sample;
+drop function val_sample_limit;
+
+\! cp /home/todd/val_limit_udf/libval_limit.so /usr/lib/
+
+create function val_limit returns integer soname 'libval_limit.so';
+create function val_limit_global returns integer soname 'libval_limit.so';
+create function val_limit_global_reset returns integer soname 'libval_limit.so';
+create function val_sample returns integer soname 'libval_limit.so';
+create function val_sample_limit returns integer soname 'libval_limit.so';
+
+-- at most 2 rows per genre in each statement
+select genre_id, count(*) from AlbumGenre where val_limit(genre_id, 2) group by genre_id;
+
+-- counts carry over between statements in the same namespace; the
+-- second select should return no rows until the namespace is reset
+select val_limit_global_reset('test');
+select genre_id, count(*) from AlbumGenre where val_limit_global('test', genre_id, 2) group by genre_id;
+select genre_id, count(*) from AlbumGenre where val_limit_global('test', genre_id, 2) group by genre_id;
+select val_limit_global_reset('test');
+select genre_id, count(*) from AlbumGenre where val_limit_global('test', genre_id, 2) group by genre_id;
+
+-- a namespace can't be reused with a different ttl (error), and an
+-- unknown namespace resets to -1
+select count(*) from AlbumGenre where val_limit_global('test', genre_id, 2, 60);
+select val_limit_global_reset('no such namespace');
+
+-- 1 row per genre per 2 second window: the third select should return
+-- rows again once the window has ended
+select genre_id, count(*) from AlbumGenre where val_limit_global('ttl', genre_id, 1, 2) group by genre_id;
+select genre_id, count(*) from AlbumGenre where val_limit_global('ttl', genre_id, 1, 2) group by genre_id;
+select sleep(2);
+select genre_id, count(*) from AlbumGenre where val_limit_global('ttl', genre_id, 1, 2) group by genre_id;
+
+-- about a tenth of the rows; the same count both times, since the seed
+-- and salt fix the rows whatever order they are read in
+select count(*) from AlbumGenre where val_sample(genre_id, 0.1, 42, album_id);
+select count(*) from (select * from AlbumGenre order by album_id desc) t
+  where val_sample(genre_id, 0.1, 42, album_id);
+
+-- no genre should show more than 2 rows
+select genre_id, count(*) c from AlbumGenre
+  where val_sample_limit(genre_id, 0.5, 2, 100, 42, album_id)
+  group by genre_id order by c desc limit 5;
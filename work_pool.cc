@@ -0,0 +1,169 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "work_pool.h"
+
+typedef struct work_job
+{
+  work_fn fn;
+  void *ctx;
+  size_t n;
+  size_t chunk;
+  size_t next;        /* start of the next chunk to hand out */
+  size_t remaining;   /* chunks not yet finished */
+  struct work_job *next_job;
+} work_job_t;
+
+struct work_pool
+{
+  pthread_mutex_t lock;
+  pthread_cond_t work_cond;   /* signalled when a job is queued or on shutdown */
+  pthread_cond_t done_cond;   /* signalled when a job finishes */
+  work_job_t *jobs;           /* jobs with chunks left to hand out */
+  bool shutdown;
+
+  unsigned int nthreads;
+  pthread_t *threads;
+};
+
+/*
+ * Takes the next chunk from the first queued job, dequeueing the job
+ * once all of its chunks are handed out. Called with the lock held.
+ */
+static work_job_t *work_pool_take(work_pool_t *pool, size_t *begin, size_t *end)
+{
+  work_job_t *job = pool->jobs;
+  if (!job)
+    return NULL;
+
+  *begin = job->next;
+  *end = (job->n - job->next > job->chunk) ? job->next + job->chunk : job->n;
+  job->next = *end;
+  if (job->next == job->n)
+    pool->jobs = job->next_job;
+  return job;
+}
+
+/* Runs one chunk; called and returns with the lock held. */
+static void work_pool_do(work_pool_t *pool, work_job_t *job,
+                         size_t begin, size_t end)
+{
+  pthread_mutex_unlock(&pool->lock);
+  job->fn(job->ctx, begin, end);
+  pthread_mutex_lock(&pool->lock);
+
+  if (--job->remaining == 0)
+    pthread_cond_broadcast(&pool->done_cond);
+}
+
+static void *work_pool_thread(void *arg)
+{
+  work_pool_t *pool = (work_pool_t *)arg;
+  size_t begin, end;
+
+  pthread_mutex_lock(&pool->lock);
+  while (!pool->shutdown)
+  {
+    work_job_t *job = work_pool_take(pool, &begin, &end);
+    if (job)
+      work_pool_do(pool, job, begin, end);
+    else
+      pthread_cond_wait(&pool->work_cond, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+work_pool_t *work_pool_new(unsigned int nthreads)
+{
+  work_pool_t *pool = (work_pool_t *)calloc(1, sizeof(work_pool_t));
+  if (!pool)
+    return NULL;
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work_cond, NULL);
+  pthread_cond_init(&pool->done_cond, NULL);
+
+  if (nthreads &&
+      !(pool->threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t))))
+  {
+    work_pool_free(pool);
+    return NULL;
+  }
+
+  for (; pool->nthreads < nthreads; pool->nthreads++)
+  {
+    if (pthread_create(&pool->threads[pool->nthreads], NULL,
+                       work_pool_thread, pool))
+    {
+      work_pool_free(pool);
+      return NULL;
+    }
+  }
+
+  return pool;
+}
+
+void work_pool_free(work_pool_t *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = true;
+  pthread_cond_broadcast(&pool->work_cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (unsigned int i = 0; i < pool->nthreads; i++)
+    pthread_join(pool->threads[i], NULL);
+
+  pthread_cond_destroy(&pool->done_cond);
+  pthread_cond_destroy(&pool->work_cond);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->threads);
+  free(pool);
+}
+
+void work_pool_run(work_pool_t *pool, size_t n, size_t min_chunk,
+                   work_fn fn, void *ctx)
+{
+  if (n == 0)
+    return;
+  if (min_chunk == 0)
+    min_chunk = 1;
+
+  if (!pool || pool->nthreads == 0 || n <= min_chunk)
+  {
+    fn(ctx, 0, n);
+    return;
+  }
+
+  /* a few chunks per thread so that uneven chunks balance out */
+  size_t chunk = n / ((pool->nthreads + 1) * 4);
+  if (chunk < min_chunk)
+    chunk = min_chunk;
+
+  work_job_t job;
+  job.fn = fn;
+  job.ctx = ctx;
+  job.n = n;
+  job.chunk = chunk;
+  job.next = 0;
+  job.remaining = (n + chunk - 1) / chunk;
+  job.next_job = NULL;
+
+  pthread_mutex_lock(&pool->lock);
+  work_job_t **tail = &pool->jobs;
+  while (*tail)
+    tail = &(*tail)->next_job;
+  *tail = &job;
+  pthread_cond_broadcast(&pool->work_cond);
+
+  /* help out with our own job until it has been fully handed out */
+  size_t begin, end;
+  while (job.next < job.n)
+  {
+    work_job_t *taken = work_pool_take(pool, &begin, &end);
+    work_pool_do(pool, taken, begin, end);
+  }
+
+  while (job.remaining > 0)
+    pthread_cond_wait(&pool->done_cond, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,31 @@
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+/**
+ * A fixed set of worker threads for splitting batch operations.
+ *
+ * work_pool_run() cuts the range [0, n) into chunks and hands them to
+ * the workers; the calling thread works on chunks too and returns once
+ * every chunk is done. Several threads may call work_pool_run() on the
+ * same pool at once.
+ */
+
+#include <stddef.h>
+
+typedef struct work_pool work_pool_t;
+
+/* called for each chunk [begin, end) of the range */
+typedef void (*work_fn)(void *ctx, size_t begin, size_t end);
+
+/* nthreads is the number of extra threads besides the caller's */
+work_pool_t *work_pool_new(unsigned int nthreads);
+void work_pool_free(work_pool_t *pool);
+
+/*
+ * Runs fn over [0, n) in chunks of at least min_chunk items. If pool is
+ * NULL or the range is small the work is done inline.
+ */
+void work_pool_run(work_pool_t *pool, size_t n, size_t min_chunk,
+                   work_fn fn, void *ctx);
+
+#endif